@@ -0,0 +1,419 @@
+// ======================================================================== //
+// Copyright 2019 Ingo Wald                                                 //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "PixelFormat.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+# include <immintrin.h>
+# define DW2_SSE2 1
+#endif
+#if defined(__ARM_NEON)
+# include <arm_neon.h>
+# define DW2_NEON 1
+#endif
+
+namespace dw2 {
+
+  /*! number of steps we quantize linear float values to before
+      looking up their sRGB encoding; sRGB is steep near zero, so
+      this needs way more than 256 */
+  static const int srgbFloatSteps = 4096;
+
+  /*! lookup tables for sRGB encoding, from linear float (quantized
+      to srgbFloatSteps) respectively from linear 8-bit */
+  struct SRGBTables {
+    SRGBTables()
+    {
+      for (int i=0;i<srgbFloatSteps;i++)
+        fromFloat[i] = encode(i/float(srgbFloatSteps-1));
+      for (int i=0;i<256;i++)
+        fromByte[i] = encode(i/255.f);
+    }
+
+    static uint8_t encode(float linear)
+    {
+      const float v
+        = linear <= 0.0031308f
+        ? 12.92f * linear
+        : 1.055f * powf(linear,1.f/2.4f) - 0.055f;
+      return uint8_t(std::min(255.f,std::max(0.f,v*255.f+.5f)));
+    }
+
+    uint8_t fromFloat[srgbFloatSteps];
+    uint8_t fromByte[256];
+  };
+
+  static const SRGBTables &srgbTables()
+  {
+    static SRGBTables tables;
+    return tables;
+  }
+
+  bool isValidFormat(dw2_format_t format)
+  {
+    switch (format) {
+    case DW2_FORMAT_RGBA8:
+    case DW2_FORMAT_BGRA8:
+    case DW2_FORMAT_RGB8:
+    case DW2_FORMAT_RGBA32F:
+    case DW2_FORMAT_RGBA16F:
+      return true;
+    }
+    return false;
+  }
+
+  size_t bytesPerPixel(dw2_format_t format)
+  {
+    switch (format) {
+    case DW2_FORMAT_RGBA8:   return 4;
+    case DW2_FORMAT_BGRA8:   return 4;
+    case DW2_FORMAT_RGB8:    return 3;
+    case DW2_FORMAT_RGBA32F: return 4*sizeof(float);
+    case DW2_FORMAT_RGBA16F: return 4*sizeof(uint16_t);
+    }
+    throw std::runtime_error("unknown pixel format");
+  }
+
+  // ==================================================================
+  // scalar helpers
+  // ==================================================================
+
+  /*! clamp to [0,1] (NaNs become 0) and scale to [0,scale] */
+  static inline int quantize(float v, float scale)
+  {
+    return int(std::min(1.f,std::max(0.f,v)) * scale + .5f);
+  }
+
+  /*! sRGB-encode the color channels of already packed pixels */
+  static void encodeSRGB(uint32_t *pixels, int numPixels)
+  {
+    const uint8_t *table = srgbTables().fromByte;
+    uint8_t *bytes = (uint8_t *)pixels;
+    for (int i=0;i<numPixels;i++,bytes+=4) {
+      bytes[0] = table[bytes[0]];
+      bytes[1] = table[bytes[1]];
+      bytes[2] = table[bytes[2]];
+    }
+  }
+
+  static inline float halfToFloat(uint16_t h)
+  {
+    const uint32_t sign = uint32_t(h & 0x8000) << 16;
+    const uint32_t expMant = h & 0x7fff;
+    // shift exponent and mantissa into place and re-bias the
+    // exponent by multiplying with 2^(127-15); that also gets
+    // denormals right
+    union { uint32_t u; float f; } v, magic;
+    magic.u = (254 - 15) << 23;
+    v.u = expMant << 13;
+    v.f *= magic.f;
+    if (expMant >= 0x7c00)
+      // inf or nan
+      v.u |= 255 << 23;
+    v.u |= sign;
+    return v.f;
+  }
+
+  // ==================================================================
+  // float RGBA
+  // ==================================================================
+
+  /*! packs four already quantized channels of 'numPixels' pixels,
+      looking up color channels in the sRGB table */
+  static inline void packSRGB(uint32_t *out, const int32_t *quantized, int numPixels)
+  {
+    const uint8_t *table = srgbTables().fromFloat;
+    for (int i=0;i<numPixels;i++,quantized+=4)
+      out[i]
+        = (table[quantized[0]] <<  0)
+        | (table[quantized[1]] <<  8)
+        | (table[quantized[2]] << 16)
+        | (uint32_t(quantized[3]) << 24);
+  }
+
+  static void convertFloatRow(uint32_t *out, const float *in, int numPixels, bool srgb)
+  {
+    // color channels get quantized finer if they still go through
+    // the sRGB table; alpha never does
+    const float colorScale = srgb ? srgbFloatSteps-1 : 255.f;
+    int i = 0;
+#if defined(__AVX2__)
+    {
+      // two pixels per register, eight pixels per iteration
+      const __m256 zero  = _mm256_setzero_ps();
+      const __m256 one   = _mm256_set1_ps(1.f);
+      const __m256 half  = _mm256_set1_ps(.5f);
+      const __m256 scale = _mm256_setr_ps(colorScale,colorScale,colorScale,255.f,
+                                          colorScale,colorScale,colorScale,255.f);
+      const __m256i order = _mm256_setr_epi32(0,4,1,5,2,6,3,7);
+      for (;i+8<=numPixels;i+=8) {
+        __m256i q[4];
+        for (int j=0;j<4;j++) {
+          // max() first, so that NaNs turn into 0
+          __m256 v = _mm256_loadu_ps(in+4*(i+2*j));
+          v = _mm256_min_ps(_mm256_max_ps(v,zero),one);
+          q[j] = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(v,scale),half));
+        }
+        if (srgb) {
+          alignas(32) int32_t quantized[32];
+          for (int j=0;j<4;j++)
+            _mm256_store_si256((__m256i*)(quantized+8*j),q[j]);
+          packSRGB(out+i,quantized,8);
+        } else {
+          // packs work per 128-bit lane, so pixels come out as
+          // 0,2,4,6 | 1,3,5,7 - permute back into order
+          const __m256i packed
+            = _mm256_packus_epi16(_mm256_packs_epi32(q[0],q[1]),
+                                  _mm256_packs_epi32(q[2],q[3]));
+          _mm256_storeu_si256((__m256i*)(out+i),
+                              _mm256_permutevar8x32_epi32(packed,order));
+        }
+      }
+    }
+#elif DW2_SSE2
+    {
+      // one pixel per register, four pixels per iteration
+      const __m128 zero  = _mm_setzero_ps();
+      const __m128 one   = _mm_set1_ps(1.f);
+      const __m128 half  = _mm_set1_ps(.5f);
+      const __m128 scale = _mm_setr_ps(colorScale,colorScale,colorScale,255.f);
+      for (;i+4<=numPixels;i+=4) {
+        __m128i q[4];
+        for (int j=0;j<4;j++) {
+          __m128 v = _mm_loadu_ps(in+4*(i+j));
+          v = _mm_min_ps(_mm_max_ps(v,zero),one);
+          q[j] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v,scale),half));
+        }
+        if (srgb) {
+          alignas(16) int32_t quantized[16];
+          for (int j=0;j<4;j++)
+            _mm_store_si128((__m128i*)(quantized+4*j),q[j]);
+          packSRGB(out+i,quantized,4);
+        } else {
+          const __m128i packed
+            = _mm_packus_epi16(_mm_packs_epi32(q[0],q[1]),
+                               _mm_packs_epi32(q[2],q[3]));
+          _mm_storeu_si128((__m128i*)(out+i),packed);
+        }
+      }
+    }
+#elif DW2_NEON
+    {
+      const float32x4_t zero  = vdupq_n_f32(0.f);
+      const float32x4_t one   = vdupq_n_f32(1.f);
+      const float32x4_t half  = vdupq_n_f32(.5f);
+      const float scaleValues[4] = { colorScale, colorScale, colorScale, 255.f };
+      const float32x4_t scale = vld1q_f32(scaleValues);
+      for (;i+4<=numPixels;i+=4) {
+        int32x4_t q[4];
+        for (int j=0;j<4;j++) {
+          float32x4_t v = vld1q_f32(in+4*(i+j));
+          // vmaxq propagates nans, so zero them out first (a nan
+          // is the only value that is not equal to itself)
+          v = vreinterpretq_f32_u32(vandq_u32(vceqq_f32(v,v),vreinterpretq_u32_f32(v)));
+          v = vminq_f32(vmaxq_f32(v,zero),one);
+          q[j] = vcvtq_s32_f32(vaddq_f32(vmulq_f32(v,scale),half));
+        }
+        if (srgb) {
+          int32_t quantized[16];
+          for (int j=0;j<4;j++)
+            vst1q_s32(quantized+4*j,q[j]);
+          packSRGB(out+i,quantized,4);
+        } else {
+          const uint16x8_t lo = vcombine_u16(vqmovun_s32(q[0]),vqmovun_s32(q[1]));
+          const uint16x8_t hi = vcombine_u16(vqmovun_s32(q[2]),vqmovun_s32(q[3]));
+          vst1q_u8((uint8_t*)(out+i),vcombine_u8(vqmovn_u16(lo),vqmovn_u16(hi)));
+        }
+      }
+    }
+#endif
+    for (;i<numPixels;i++) {
+      const float *pixel = in+4*i;
+      int32_t quantized[4] = {
+        quantize(pixel[0],colorScale),
+        quantize(pixel[1],colorScale),
+        quantize(pixel[2],colorScale),
+        quantize(pixel[3],255.f)
+      };
+      if (srgb)
+        packSRGB(out+i,quantized,1);
+      else
+        out[i]
+          = (quantized[0] <<  0)
+          | (quantized[1] <<  8)
+          | (quantized[2] << 16)
+          | (uint32_t(quantized[3]) << 24);
+    }
+  }
+
+  // ==================================================================
+  // half-float RGBA
+  // ==================================================================
+
+  static void convertHalfRow(uint32_t *out, const uint16_t *in, int numPixels, bool srgb)
+  {
+    // expand into a small, cache-resident block of floats, and run
+    // that through the float path
+    const int blockSize = 64;
+    alignas(32) float block[4*blockSize];
+    for (int begin=0;begin<numPixels;begin+=blockSize) {
+      const int numInBlock = std::min(blockSize,numPixels-begin);
+      const uint16_t *h = in+4*begin;
+      const int numValues = 4*numInBlock;
+      int i = 0;
+#if defined(__F16C__)
+      for (;i+8<=numValues;i+=8)
+        _mm256_store_ps(block+i,_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h+i))));
+#elif DW2_NEON && defined(__aarch64__)
+      for (;i+4<=numValues;i+=4)
+        vst1q_f32(block+i,vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(h+i))));
+#elif DW2_SSE2
+      {
+        // same trick as the scalar halfToFloat(), four at a time
+        const __m128i maskExpMant = _mm_set1_epi32(0x7fff);
+        const __m128i maxFinite   = _mm_set1_epi32(0x7bff);
+        const __m128i infNanExp   = _mm_set1_epi32(255 << 23);
+        const __m128  magic       = _mm_castsi128_ps(_mm_set1_epi32((254 - 15) << 23));
+        const __m128i zero        = _mm_setzero_si128();
+        for (;i+4<=numValues;i+=4) {
+          const __m128i v = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(h+i)),zero);
+          const __m128i expMant = _mm_and_si128(v,maskExpMant);
+          const __m128i sign    = _mm_slli_epi32(_mm_xor_si128(v,expMant),16);
+          const __m128  scaled
+            = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(expMant,13)),magic);
+          const __m128i infNan
+            = _mm_and_si128(_mm_cmpgt_epi32(expMant,maxFinite),infNanExp);
+          _mm_store_ps(block+i,
+                       _mm_or_ps(scaled,_mm_castsi128_ps(_mm_or_si128(sign,infNan))));
+        }
+      }
+#endif
+      for (;i<numValues;i++)
+        block[i] = halfToFloat(h[i]);
+      convertFloatRow(out+begin,block,numInBlock,srgb);
+    }
+  }
+
+  // ==================================================================
+  // 8-bit formats
+  // ==================================================================
+
+  static void convertBGRA8Row(uint32_t *out, const uint32_t *in, int numPixels)
+  {
+    int i = 0;
+#if defined(__AVX2__)
+    {
+      const __m256i keep = _mm256_set1_epi32(0xff00ff00);
+      const __m256i low  = _mm256_set1_epi32(0x000000ff);
+      for (;i+8<=numPixels;i+=8) {
+        const __m256i v = _mm256_loadu_si256((const __m256i*)(in+i));
+        const __m256i swapped
+          = _mm256_or_si256(_mm256_and_si256(v,keep),
+                            _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(v,16),low),
+                                            _mm256_slli_epi32(_mm256_and_si256(v,low),16)));
+        _mm256_storeu_si256((__m256i*)(out+i),swapped);
+      }
+    }
+#elif DW2_SSE2
+    {
+      const __m128i keep = _mm_set1_epi32(0xff00ff00);
+      const __m128i low  = _mm_set1_epi32(0x000000ff);
+      for (;i+4<=numPixels;i+=4) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(in+i));
+        const __m128i swapped
+          = _mm_or_si128(_mm_and_si128(v,keep),
+                         _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v,16),low),
+                                      _mm_slli_epi32(_mm_and_si128(v,low),16)));
+        _mm_storeu_si128((__m128i*)(out+i),swapped);
+      }
+    }
+#elif DW2_NEON
+    for (;i+4<=numPixels;i+=4) {
+      uint8x16_t v = vld1q_u8((const uint8_t*)(in+i));
+      // swap bytes 0 and 2 of every pixel
+      const uint8_t order[16] = { 2,1,0,3, 6,5,4,7, 10,9,8,11, 14,13,12,15 };
+      vst1q_u8((uint8_t*)(out+i),vqtbl1q_u8(v,vld1q_u8(order)));
+    }
+#endif
+    for (;i<numPixels;i++) {
+      const uint32_t v = in[i];
+      out[i] = (v & 0xff00ff00) | ((v >> 16) & 0xff) | ((v & 0xff) << 16);
+    }
+  }
+
+  static void convertRGB8Row(uint32_t *out, const uint8_t *in, int numPixels)
+  {
+    int i = 0;
+#if defined(__SSSE3__)
+    {
+      // four pixels out of every 12 bytes; we load 16, so stop early
+      // enough not to read past the end of the row
+      const __m128i order = _mm_setr_epi8(0,1,2,-1, 3,4,5,-1, 6,7,8,-1, 9,10,11,-1);
+      const __m128i alpha = _mm_set1_epi32(0xff000000);
+      for (;i+6<=numPixels;i+=4) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(in+3*i));
+        _mm_storeu_si128((__m128i*)(out+i),
+                         _mm_or_si128(_mm_shuffle_epi8(v,order),alpha));
+      }
+    }
+#elif DW2_NEON
+    for (;i+16<=numPixels;i+=16) {
+      const uint8x16x3_t rgb = vld3q_u8(in+3*i);
+      uint8x16x4_t rgba;
+      rgba.val[0] = rgb.val[0];
+      rgba.val[1] = rgb.val[1];
+      rgba.val[2] = rgb.val[2];
+      rgba.val[3] = vdupq_n_u8(255);
+      vst4q_u8((uint8_t*)(out+i),rgba);
+    }
+#endif
+    for (;i<numPixels;i++) {
+      const uint8_t *pixel = in+3*i;
+      out[i] = pixel[0] | (pixel[1] << 8) | (pixel[2] << 16) | 0xff000000;
+    }
+  }
+
+  /*! convert one row of 'numPixels' pixels in given format to the
+    packed 8-bit RGBA the wall uses */
+  void convertRow(uint32_t *out, const void *in, int numPixels,
+                  dw2_format_t format, bool srgb)
+  {
+    switch (format) {
+    case DW2_FORMAT_RGBA32F:
+      convertFloatRow(out,(const float *)in,numPixels,srgb);
+      return;
+    case DW2_FORMAT_RGBA16F:
+      convertHalfRow(out,(const uint16_t *)in,numPixels,srgb);
+      return;
+    case DW2_FORMAT_RGBA8:
+      memcpy(out,in,numPixels*sizeof(uint32_t));
+      break;
+    case DW2_FORMAT_BGRA8:
+      convertBGRA8Row(out,(const uint32_t *)in,numPixels);
+      break;
+    case DW2_FORMAT_RGB8:
+      convertRGB8Row(out,(const uint8_t *)in,numPixels);
+      break;
+    default:
+      throw std::runtime_error("unknown pixel format");
+    }
+    // 8-bit inputs are still in cache from the above, so encoding
+    // them in a second pass doesn't touch memory again
+    if (srgb)
+      encodeSRGB(out,numPixels);
+  }
+
+} // ::dw2
@@ -0,0 +1,37 @@
+// ======================================================================== //
+// Copyright 2019 Ingo Wald                                                 //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "dw2_client.h"
+#include "../common/common.h"
+
+namespace dw2 {
+
+  /*! whether given format is one of dw2_format_t's */
+  bool isValidFormat(dw2_format_t format);
+
+  /*! size of one pixel of given format, in bytes */
+  size_t bytesPerPixel(dw2_format_t format);
+
+  /*! convert one row of 'numPixels' pixels in given format to the
+      packed 8-bit RGBA the wall uses; float formats get clamped to
+      [0,1]. If 'srgb' is set, color (but not alpha) channels get
+      sRGB-encoded on the way. */
+  void convertRow(uint32_t *out, const void *in, int numPixels,
+                  dw2_format_t format, bool srgb);
+
+} // ::dw2
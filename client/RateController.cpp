@@ -0,0 +1,218 @@
+// ======================================================================== //
+// Copyright 2019 Ingo Wald                                                 //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "RateController.h"
+// std
+#include <cmath>
+
+namespace dw2 {
+
+  /*! range the controller moves quality in */
+  static const int minQuality = 10;
+  static const int maxQuality = 95;
+
+  /*! what tiles in a region of interest get, whatever their link's
+      quality is */
+  static const int roiQuality = 95;
+
+  /*! weight of the newest sample in our running averages */
+  static const double smoothing = .5;
+
+  static inline double smoothed(double average, double sample)
+  {
+    return average == 0.
+      ? sample
+      : (1.-smoothing)*average + smoothing*sample;
+  }
+
+  /*! more quality means less need for chroma subsampling */
+  static inline EncodeParams::ChromaSubsampling subsamplingFor(int quality)
+  {
+    if (quality >= 90) return EncodeParams::CHROMA_444;
+    if (quality >= 80) return EncodeParams::CHROMA_422;
+    return EncodeParams::CHROMA_420;
+  }
+
+  RateController::RateController(int numLinks)
+  {
+    const EncodeParams defaults;
+    for (int i=0;i<numLinks;i++) {
+      links.push_back(std::unique_ptr<Link>(new Link));
+      links.back()->quality     = defaults.quality;
+      links.back()->subsampling = defaults.subsampling;
+    }
+  }
+
+  /*! set the targets to control for; 0 means 'no target' */
+  void RateController::setTargets(double framesPerSecond, double bytesPerSecondPerLink)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    targetFramesPerSecond = framesPerSecond;
+    targetBytesPerSecond  = bytesPerSecondPerLink;
+    if (framesPerSecond <= 0. && bytesPerSecondPerLink <= 0.) {
+      // nothing to control for any more: back to the defaults, not
+      // stuck with whatever we last controlled the links to
+      const EncodeParams defaults;
+      for (auto &link : links) {
+        link->quality     = defaults.quality;
+        link->subsampling = defaults.subsampling;
+      }
+    }
+  }
+
+  /*! encoder parameters to use for given link right now */
+  EncodeParams RateController::paramsFor(int linkID) const
+  {
+    EncodeParams params;
+    params.quality     = links[linkID]->quality;
+    params.subsampling = (EncodeParams::ChromaSubsampling)(int)links[linkID]->subsampling;
+    return params;
+  }
+
+  /*! distance (in pixels) between the closest pixels of two boxes;
+      0 if they overlap */
+  static inline float distanceBetween(const box2i &a, const box2i &b)
+  {
+    const int dx = std::max(0,std::max(a.lower.x-b.upper.x,b.lower.x-a.upper.x));
+    const int dy = std::max(0,std::max(a.lower.y-b.upper.y,b.lower.y-a.upper.y));
+    return sqrtf(float(dx)*dx+float(dy)*dy);
+  }
+  
+  /*! encoder parameters to use for a tile of given region on given
+    link right now */
+  EncodeParams RateController::paramsFor(int linkID, const box2i &region) const
+  {
+    EncodeParams params = paramsFor(linkID);
+    std::shared_ptr<const RegionsOfInterest> rois = std::atomic_load(&regionsOfInterest);
+    if (!rois) return params;
+
+    float distance = INFINITY;
+    for (auto &roi : rois->regions)
+      distance = std::min(distance,distanceBetween(region,roi));
+    if (distance == 0.f) {
+      params.quality     = std::max(params.quality,roiQuality);
+      params.subsampling = EncodeParams::CHROMA_444;
+      return params;
+    }
+
+    // linearly down from the link's quality to the minimum
+    const float falloff = std::min(1.f,distance/std::max(1,rois->falloff));
+    params.quality
+      = std::min(params.quality,
+                 int(params.quality - falloff*(params.quality-minQuality)));
+    // ... and never less subsampling than the link already uses
+    params.subsampling
+      = std::max(params.subsampling,subsamplingFor(params.quality));
+    return params;
+  }
+
+  /*! tiles that overlap any of the given regions get top quality,
+    all others less the further away they are */
+  void RateController::setRegionsOfInterest(const std::vector<box2i> &regions, int falloff)
+  {
+    std::shared_ptr<const RegionsOfInterest> rois;
+    if (!regions.empty())
+      rois = std::make_shared<RegionsOfInterest>(RegionsOfInterest{ regions, falloff });
+    std::atomic_store(&regionsOfInterest,rois);
+  }
+
+  RateController::LinkStats RateController::getStats(int linkID) const
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    LinkStats stats;
+    stats.params         = paramsFor(linkID);
+    stats.bytesPerFrame  = links[linkID]->bytesPerFrame;
+    stats.bytesPerSecond = links[linkID]->bytesPerSecond;
+    return stats;
+  }
+
+  /*! once per frame: update the measurements, and re-compute every
+    link's parameters */
+  void RateController::endFrame(const std::vector<SocketGroup::Remote::SP> &remotes)
+  {
+    assert(remotes.size() == links.size());
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const double now = getCurrentTime();
+    const bool firstFrame = (lastEndFrameTime < 0.);
+    if (!firstFrame)
+      frameSeconds = smoothed(frameSeconds,now-lastEndFrameTime);
+    lastEndFrameTime = now;
+
+    for (size_t linkID=0;linkID<links.size();linkID++) {
+      Link &link = *links[linkID];
+      const SocketGroup::Remote &remote = *remotes[linkID];
+
+      // ------------------------------------------------------------------
+      // measure
+      // ------------------------------------------------------------------
+      const uint64_t bytesEncoded = link.bytesEncoded;
+      const uint64_t bytesWritten = remote.bytesWritten;
+      const uint64_t usecsWriting = remote.usecsWriting;
+      if (!firstFrame) {
+        link.bytesPerFrame
+          = smoothed(link.bytesPerFrame,double(bytesEncoded-link.bytesEncodedBefore));
+        // too little time spent writing says nothing about the
+        // link, other than that it is not what holds us up
+        const uint64_t usecs = usecsWriting - link.usecsWritingBefore;
+        if (usecs > 1000)
+          link.bytesPerSecond
+            = smoothed(link.bytesPerSecond,
+                       (bytesWritten - link.bytesWrittenBefore) / (usecs*1e-6));
+      }
+      link.bytesEncodedBefore = bytesEncoded;
+      link.bytesWrittenBefore = bytesWritten;
+      link.usecsWritingBefore = usecsWriting;
+
+      // ------------------------------------------------------------------
+      // and control: how many bytes may this link send per frame?
+      // ------------------------------------------------------------------
+      if (firstFrame || link.bytesPerFrame == 0.) continue;
+
+      double allowedBytesPerSecond = 0.;
+      if (targetBytesPerSecond > 0.)
+        allowedBytesPerSecond = targetBytesPerSecond;
+      if (targetFramesPerSecond > 0. && link.bytesPerSecond > 0.)
+        allowedBytesPerSecond
+          = allowedBytesPerSecond > 0.
+          ? std::min(allowedBytesPerSecond,link.bytesPerSecond)
+          : link.bytesPerSecond;
+      if (allowedBytesPerSecond == 0.)
+        // nothing to control for
+        continue;
+
+      const double secondsPerFrame
+        = targetFramesPerSecond > 0.
+        ? 1./targetFramesPerSecond
+        : frameSeconds;
+      const double budget = allowedBytesPerSecond * secondsPerFrame;
+      const double ratio  = link.bytesPerFrame / budget;
+
+      int quality = link.quality;
+      if (ratio > 1.)
+        // over budget: back off quickly, the more the further off
+        // we are
+        quality -= std::min(15,1+int(20.*(ratio-1.)));
+      else if (ratio < .75)
+        // well within budget: creep back up
+        quality += 2;
+      quality = std::max(minQuality,std::min(maxQuality,quality));
+      link.quality     = quality;
+      link.subsampling = subsamplingFor(quality);
+    }
+  }
+
+} // ::dw2
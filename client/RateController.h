@@ -0,0 +1,120 @@
+// ======================================================================== //
+// Copyright 2019 Ingo Wald                                                 //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "../common/CompressedTile.h"
+#include "../common/SocketGroup.h"
+// std
+#include <atomic>
+#include <memory>
+
+namespace dw2 {
+
+  /*! picks the encoder parameters for every display link, once per
+      frame, such that what we send over each link fits a target
+      frame rate and/or a per-link bandwidth budget: links that send
+      more bytes per frame than their budget allows get lower quality
+      (and, eventually, more chroma subsampling), links with room to
+      spare get higher quality. Without any target set, every link
+      keeps the default EncodeParams. On top of that, tiles can get
+      more or less quality than their link's, depending on how far
+      they are from where the viewers look (see
+      setRegionsOfInterest()). */
+  struct RateController {
+    typedef std::shared_ptr<RateController> SP;
+
+    /*! what the controller currently does on one link */
+    struct LinkStats {
+      EncodeParams params;
+      /*! (smoothed) encoded bytes per frame on this link */
+      double       bytesPerFrame  { 0. };
+      /*! (smoothed) bandwidth we measured on this link; 0 if we do
+          not know yet */
+      double       bytesPerSecond { 0. };
+    };
+
+    RateController(int numLinks);
+
+    /*! set the targets to control for; 0 means 'no target' for
+        either. Clearing both puts every link back to the default
+        EncodeParams */
+    void setTargets(double framesPerSecond, double bytesPerSecondPerLink);
+
+    /*! encoder parameters to use for given link right now */
+    EncodeParams paramsFor(int linkID) const;
+
+    /*! encoder parameters to use for a tile of given region on given
+        link right now: the link's, adjusted for the regions of
+        interest (if any) */
+    EncodeParams paramsFor(int linkID, const box2i &region) const;
+
+    /*! tiles that overlap any of the given regions get top quality;
+        all others get their link's quality, lowered more and more the
+        further away they are, down to the lowest we ever use at
+        'falloff' pixels away. Regions are in the same coordinates as
+        the tiles; none at all turns this off */
+    void setRegionsOfInterest(const std::vector<box2i> &regions, int falloff);
+
+    /*! account for 'numBytes' (encoded) bytes going to given link */
+    void addBytes(int linkID, size_t numBytes)
+    { links[linkID]->bytesEncoded += numBytes; }
+
+    /*! to be called once per frame, with the socket group's remotes
+        (one per link, in the same order); updates the measurements
+        and re-computes every link's parameters */
+    void endFrame(const std::vector<SocketGroup::Remote::SP> &remotes);
+
+    LinkStats getStats(int linkID) const;
+
+    int numLinks() const { return (int)links.size(); }
+
+  private:
+    struct Link {
+      /*! the parameters the compressor threads use; written only by
+          endFrame(), read by everybody */
+      std::atomic<int>      quality;
+      std::atomic<int>      subsampling;
+      /*! encoded bytes so far; written by the compressor threads */
+      std::atomic<uint64_t> bytesEncoded { 0 };
+
+      /*! the rest is only ever touched with the mutex locked */
+      uint64_t bytesEncodedBefore { 0 };
+      uint64_t bytesWrittenBefore { 0 };
+      uint64_t usecsWritingBefore { 0 };
+      double   bytesPerFrame      { 0. };
+      double   bytesPerSecond     { 0. };
+    };
+
+    struct RegionsOfInterest {
+      std::vector<box2i> regions;
+      int                falloff;
+    };
+    
+    std::vector<std::unique_ptr<Link>> links;
+    /*! only ever replaced as a whole (with std::atomic_store), so the
+        compressor threads can read it without taking the mutex */
+    std::shared_ptr<const RegionsOfInterest> regionsOfInterest;
+    mutable std::mutex                 mutex;
+    double                             targetFramesPerSecond { 0. };
+    double                             targetBytesPerSecond  { 0. };
+    /*! (smoothed) time between two endFrame()s, and when the last
+        one was */
+    double                             frameSeconds          { 0. };
+    double                             lastEndFrameTime      { -1. };
+  };
+
+} // ::dw2
@@ -16,9 +16,16 @@
 
 //#include "include/dw2.h"
 #include "dw2_client.h"
+#include "PixelFormat.h"
+#include "RateController.h"
 #include "../common/ServiceInfo.h"
 #include "../common/SocketGroup.h"
 #include "../common/CompressedTile.h"
+#include "../common/Blit.h"
+// std
+#include <map>
+#include <array>
+#include <algorithm>
 
 namespace dw2 {
 
@@ -33,17 +40,92 @@ namespace dw2 {
     
     void compressorThreadFunc();
 
-    void put(PlainTile::SP tile) {
-      std::lock_guard<std::mutex> lock(mutex);
-      tilesToSend.push_back(tile);
-      newWorkAvailable.notify_one();
-    }
+    /*! sends the tiles queued up in tilesToRefine, one at a time,
+        whenever a link has nothing else to do */
+    void refinerThreadFunc();
+
+    /*! queue up the given tile for the compressor threads - or,
+        if it is too big for a single one of them, its slices */
+    void put(PlainTile::SP tile) { put(&tile,1); }
+
+    /*! put a whole batch of tiles, waking up encoders in one go */
+    void put(const PlainTile::SP *tiles, size_t count);
+
+    /*! append the given tile to 'out' - or, if it is too big, its
+        slices */
+    void appendSlices(std::vector<PlainTile::SP> &out, const PlainTile::SP &tile);
+
+    /*! get a tile from the pool that the app can write into directly,
+        and remember it until the app commits it */
+    PlainTile::SP mapTile(const box2i &region);
+
+    /*! look up the mapped tile that 'pixels' belongs to, and send
+        it; returns false if there is no such tile */
+    bool commitTile(uint32_t *pixels);
+
+    /*! checks whether the given tile has exactly the same pixels as
+        the one we sent for the same region (and eye) in the frame
+        before; and remembers this tile's hash for the next frame,
+        along with whether it is about to get sent 'lossy'. If the
+        tile is unchanged, but was sent lossy, 'refineFrameID'
+        returns the frame the display got these (lossy) pixels in,
+        else -1 */
+    bool isUnchanged(const PlainTile &tile, bool lossy, int &refineFrameID);
+
+    /*! whether the given refinement (with the frame it refines in
+        'frameID') still is what the display shows for its region */
+    bool isStillCurrent(const PlainTile &refinement, uint64_t hash);
+
+    /*! forget about tiles that are too old to ever be compared
+        against again */
+    void pruneSentTiles(int oldestFrameID);
     
-    std::mutex                mutex;
-    std::condition_variable   newWorkAvailable;
-    std::deque<PlainTile::SP> tilesToSend;
+    /*! tiles the app has submitted, but no compressor thread has
+        picked up yet */
+    MPMCQueue<PlainTile::SP>  tilesToSend;
     std::vector<std::thread>  compressorThreads;
+    /*! where the tiles we're sending come from; the compressor
+        threads put them back once encoded */
+    PlainTilePool             tilePool;
+    /*! tiles the app has mapped, but not yet committed */
+    std::vector<PlainTile::SP> mappedTiles;
+    std::mutex                mappedTilesMutex;
+    /*! the scale the app renders at; see dw2_set_render_scale() */
+    int                       renderScale { 1 };
+    /*! the TileCodec we encode with; the first of ours that the
+        service supports, too */
+    std::atomic<int>          codec { CODEC_PLAIN };
+    /*! whether the service can decode solid and palette tiles; if
+        so, every tile goes to classifyTile() first, and only what
+        that does not find a better codec for gets 'codec' */
+    bool                      classifyTiles { false };
+    /*! what the displays' temporal decoders have for every region;
+        shared by all our temporal encoders */
+    ReferenceTiles::SP        references { std::make_shared<ReferenceTiles>() };
+    /*! copies of tiles that the app no longer changes, but that went
+        out lossy; these get sent again, losslessly, whenever the
+        links have time for it */
+    MPMCQueue<PlainTile::SP>  tilesToRefine;
+    std::thread               refinerThread;
+    /*! the (lossless) TileCodec we refine with */
+    int                       refinementCodec { CODEC_PLAIN };
+    /*! what we have sent for a given region and eye: the hash of its
+        pixels, and the frame we sent it in */
+    struct SentTile {
+      uint64_t hash;
+      int      frameID;
+      /*! the frame these pixels were first sent in (ie, not as
+          'unchanged'); what the display shows is from that frame */
+      int      firstFrameID;
+      /*! whether they were sent lossy, and not refined yet */
+      bool     needsRefinement;
+    };
+    /*! last sent tile for every region (lower.x,lower.y,upper.x,upper.y,eye,scale) */
+    std::map<std::array<int,6>,SentTile> sentTiles;
+    std::mutex                sentTilesMutex;
     SocketGroup::SP serviceSockets;
+    /*! picks encoder parameters per display link */
+    RateController::SP rateController;
     SocketGroup::SP controlWindowServiceSocket;
     ServiceInfo::SP serviceInfo;
     // ControlWindowImageInfo::SP controlWindowImageInfo;
@@ -53,36 +135,260 @@ namespace dw2 {
   };
 
 
+  /*! the region, in coordinates of a wall rendered at 1/scale, that
+      covers (at least) the given native region; pixels that straddle
+      the border of two native regions belong to both */
+  inline box2i scaledDown(const box2i &region, int scale)
+  {
+    return box2i(vec2i(region.lower.x/scale,region.lower.y/scale),
+                 divRoundUp(region.upper,vec2i(scale)));
+  }
+
+  inline bool contains(const std::vector<int> &codecs, int codec)
+  { return std::find(codecs.begin(),codecs.end(),codec) != codecs.end(); }
+  
+  /*! tiles with more pixels than this get cut into horizontal
+      slices that the compressor threads encode in parallel, and
+      that go out as tiles of their own */
+  static const int maxSlicePixels = 256*256;
+  /*! slices are a multiple of this many rows high, such that jpeg's
+      (and the block codec's) blocks do not straddle two slices */
+  static const int sliceRowAlignment = 16;
+  
+  /*! append the given tile to 'out' - or, if it is too big, its
+      slices. Slices come from the tile pool, refer to the tile's
+      pixels, and keep its storage alive until they are done with
+      it; the tile itself goes back to the pool right away */
+  void Client::appendSlices(std::vector<PlainTile::SP> &out, const PlainTile::SP &tile)
+  {
+    const vec2i size = tile->size();
+    if (size.product() <= maxSlicePixels) {
+      out.push_back(tile);
+      return;
+    }
+    const int rowsPerSlice
+      = std::max(sliceRowAlignment,
+                 maxSlicePixels/size.x/sliceRowAlignment*sliceRowAlignment);
+    const box2i &region = tile->region;
+    std::vector<box2i> sliceRegions;
+    for (int y0=region.lower.y;y0<region.upper.y;y0+=rowsPerSlice)
+      sliceRegions.push_back(box2i(vec2i(region.lower.x,y0),
+                                   vec2i(region.upper.x,std::min(y0+rowsPerSlice,region.upper.y))));
+    const size_t numBefore = out.size();
+    out.resize(numBefore+sliceRegions.size());
+    tilePool.getSubTiles(out.data()+numBefore,*tile,sliceRegions.data(),sliceRegions.size());
+    // the slices hold on to the storage now; without it, the tile
+    // is just another free one
+    tile->storage = nullptr;
+    tilePool.release(tile);
+  }
+
+  /*! put a whole batch of tiles, waking up encoders in one go */
+  void Client::put(const PlainTile::SP *tiles, size_t count)
+  {
+    // the same region always gets cut the same way, so every slice
+    // still is the same region as in the frame before, and can be
+    // compared against that
+    std::vector<PlainTile::SP> slices;
+    for (size_t i=0;i<count;i++)
+      appendSlices(slices,tiles[i]);
+    tilesToSend.push(slices.data(),slices.size());
+  }
+  
+  /*! the first of the (general) codecs we support that the service
+      supports, too */
+  int pickCodec(const std::vector<int> &serviceCodecs)
+  {
+    for (auto codec : supportedCodecs())
+      if (isGeneralCodec(codec) && contains(serviceCodecs,codec))
+        return codec;
+    throw std::runtime_error("dw2.client: the display service does not support"
+                             " any of the tile codecs this client supports");
+  }
+  
   void Client::compressorThreadFunc()
   {
-    TileEncoder::SP encoder = TileEncoder::create();
+    /*! one encoder per codec, created on first use */
+    TileEncoder::SP encoders[NUM_CODECS];
     
     while (1) {
-      PlainTile::SP tile;
-      {
-        std::unique_lock<std::mutex> lock(mutex);
-        while (tilesToSend.empty())
-          newWorkAvailable.wait(lock);
-        tile = tilesToSend.front();
-        tilesToSend.pop_front();
-      }
-      Mailbox::Message::SP tileMessage = encoder->encode(*tile);
-      // std::cout << "tile size after compression : " << tileMessage ->outSize << "\n";
-      // compressRatio.push_back((float)tileMessage ->outSize);
-      // compressRatio.push_back(1 - ((float)tileMessage ->outSize / (tile->size().x * tile->size().y * 4)));
+      PlainTile::SP tile = tilesToSend.pop();
+      // solid and few-color tiles (backgrounds, UI) are better off
+      // with codecs of their own, whatever the app picked for the
+      // rest - unless that is plain, which costs no encoding time
+      // at all
+      const int codec
+        = classifyTiles && this->codec != CODEC_PLAIN
+        ? classifyTile(*tile,this->codec)
+        : (int)this->codec;
+      TileEncoder::SP &encoder = encoders[codec];
+      if (!encoder)
+        encoder = TileEncoder::create(codec,references);
+      // if the app re-sent what this region already showed last
+      // frame, the displays can just keep those pixels
+      int refineFrameID;
+      const bool unchanged = isUnchanged(*tile,isLossy(codec),refineFrameID);
       // ------------------------------------------------------------------
-      // now put this message into every remote that needs it.
+      // cut the tile at display boundaries, and encode each piece
+      // only for the one display that actually shows it - pixels
+      // that fall into bezels don't get sent at all
       // ------------------------------------------------------------------
-      std::vector<int> toRanks;
-      for (int remoteID = 0; remoteID < serviceInfo->nodes.size(); remoteID++) {
-        if (serviceInfo->nodes[remoteID].region.overlaps(tile->region)) {
-          //serviceSockets->remotes[remoteID]->outbox->put(tileMessage);
-          toRanks.push_back(remoteID);
-        }
+      for (size_t remoteID = 0; remoteID < serviceInfo->nodes.size(); remoteID++) {
+        const box2i displayRegion
+          = scaledDown(serviceInfo->nodes[remoteID].region,tile->scale);
+        if (!displayRegion.overlaps(tile->region))
+          continue;
+        
+        PlainTile piece = tile->subTile(intersectionOf(displayRegion,tile->region));
+        if (unchanged)
+          // the display does the same once it sees that message
+          references->touch(piece.region,piece.eye,piece.scale,piece.frameID);
+        Mailbox::Message::SP tileMessage
+          = unchanged
+          ? makeUnchangedTileMessage(piece)
+          : encoder->encode(piece,rateController->paramsFor(remoteID,piece.region));
+        rateController->addBytes(remoteID,tileMessage->size());
+        serviceSockets->sendTo({ (int)remoteID }, tileMessage);
+      }
+      if (refineFrameID >= 0) {
+        // the app has stopped changing this tile, but the displays
+        // only have a lossy version of it: queue up a copy (this
+        // one goes back to the pool) to send losslessly, later
+        PlainTile::SP refinement = tilePool.get(tile->region,tile->eye,refineFrameID);
+        refinement->scale = tile->scale;
+        blit(refinement->pixels,refinement->region,refinement->pitch,
+             tile->pixels,tile->region,tile->pitch);
+        tilesToRefine.push(refinement);
       }
-      serviceSockets->sendTo(toRanks, tileMessage);
+      tilePool.release(tile);
     }
   }
+
+  void Client::refinerThreadFunc()
+  {
+    TileEncoder::SP encoder = TileEncoder::create(refinementCodec);
+    
+    while (1) {
+      PlainTile::SP tile = tilesToRefine.pop();
+      const uint64_t hash = tile->hash();
+      for (size_t remoteID = 0; remoteID < serviceInfo->nodes.size(); remoteID++) {
+        const box2i displayRegion
+          = scaledDown(serviceInfo->nodes[remoteID].region,tile->scale);
+        if (!displayRegion.overlaps(tile->region))
+          continue;
+
+        // refinements only get the link time nobody else needs; and
+        // by the time the link has some, the app may have changed
+        // the tile again (which, as the changed tile has to go out
+        // first, we will find out once the link is idle)
+        serviceSockets->remotes[remoteID]->waitUntilIdle();
+        if (!isStillCurrent(*tile,hash))
+          break;
+
+        Mailbox::Message::SP refinementMessage
+          = encoder->encode(tile->subTile(intersectionOf(displayRegion,tile->region)));
+        ((TileMessageDataHeader *)refinementMessage->data())->flags
+          |= TileMessageDataHeader::REFINEMENT;
+        serviceSockets->sendTo({ (int)remoteID }, refinementMessage);
+      }
+      tilePool.release(tile);
+    }
+  }
+
+  /*! whether the given refinement still is what the display shows
+    for its region */
+  bool Client::isStillCurrent(const PlainTile &refinement, uint64_t hash)
+  {
+    const std::array<int,6> key
+      = {{ refinement.region.lower.x, refinement.region.lower.y,
+           refinement.region.upper.x, refinement.region.upper.y,
+           refinement.eye, refinement.scale }};
+    std::lock_guard<std::mutex> lock(sentTilesMutex);
+    auto it = sentTiles.find(key);
+    return
+      it != sentTiles.end()
+      && it->second.firstFrameID == refinement.frameID
+      && it->second.hash == hash;
+  }
+
+  /*! checks whether the given tile has exactly the same pixels as the
+    one we sent for the same region (and eye) in the frame before */
+  bool Client::isUnchanged(const PlainTile &tile, bool lossy, int &refineFrameID)
+  {
+    refineFrameID = -1;
+    const uint64_t hash = tile.hash();
+    const std::array<int,6> key
+      = {{ tile.region.lower.x, tile.region.lower.y,
+           tile.region.upper.x, tile.region.upper.y, tile.eye, tile.scale }};
+
+    std::lock_guard<std::mutex> lock(sentTilesMutex);
+    auto it = sentTiles.find(key);
+    if (it == sentTiles.end()) {
+      sentTiles[key] = { hash, tile.frameID, tile.frameID, lossy };
+      return false;
+    }
+    SentTile &sent = it->second;
+    // the display only keeps the previous frame around, so we can
+    // only skip if that is where the matching tile went; and with
+    // several frames in flight a newer frame's tile may already have
+    // been here, which we must not overwrite
+    const bool unchanged
+      = sent.frameID == tile.frameID-1
+      && sent.hash == hash;
+    if (unchanged) {
+      sent.frameID = tile.frameID;
+      if (sent.needsRefinement)
+        refineFrameID = sent.firstFrameID;
+      sent.needsRefinement = false;
+    } else if (tile.frameID > sent.frameID)
+      sent = { hash, tile.frameID, tile.frameID, lossy };
+    return unchanged;
+  }
+
+  /*! forget about tiles that are too old to ever be compared against
+    again */
+  void Client::pruneSentTiles(int oldestFrameID)
+  {
+    std::lock_guard<std::mutex> lock(sentTilesMutex);
+    for (auto it = sentTiles.begin(); it != sentTiles.end(); )
+      if (it->second.frameID < oldestFrameID)
+        it = sentTiles.erase(it);
+      else
+        ++it;
+  }
+  
+  /*! get a tile from the pool that the app can write into directly,
+    and remember it until the app commits it */
+  PlainTile::SP Client::mapTile(const box2i &region)
+  {
+    PlainTile::SP tile = tilePool.get(region,0,g_frameID);
+    tile->scale = renderScale;
+    std::lock_guard<std::mutex> lock(mappedTilesMutex);
+    mappedTiles.push_back(tile);
+    return tile;
+  }
+
+  /*! look up the mapped tile that 'pixels' belongs to, and send it */
+  bool Client::commitTile(uint32_t *pixels)
+  {
+    PlainTile::SP tile;
+    {
+      std::lock_guard<std::mutex> lock(mappedTilesMutex);
+      // there are only ever as many mapped tiles as the app has
+      // render threads, so a linear search is just fine
+      for (size_t i=0;i<mappedTiles.size();i++)
+        if (mappedTiles[i]->pixels == pixels) {
+          tile = mappedTiles[i];
+          mappedTiles[i] = mappedTiles.back();
+          mappedTiles.pop_back();
+          break;
+        }
+    }
+    if (!tile)
+      return false;
+    put(tile);
+    return true;
+  }
   
 
   
@@ -90,12 +396,17 @@ namespace dw2 {
     : compressorThreads(numThreads)
   {
     // std::cout << "num threads : " << numThreads << "\n";
-    for (auto &ct : compressorThreads)
-      ct = std::thread([this](){this->compressorThreadFunc();});
-
     serviceInfo = ServiceInfo::getInfo(hostName, port);
     assert(serviceInfo);
     std::cout << "dw2.clent: receive service info (Client::Client) " << "\n";
+    codec = pickCodec(serviceInfo->codecs);
+    refinementCodec
+      = contains(serviceInfo->codecs,CODEC_LOSSLESS)
+      ? CODEC_LOSSLESS
+      : CODEC_PLAIN;
+    classifyTiles
+      = contains(serviceInfo->codecs,CODEC_SOLID)
+      && contains(serviceInfo->codecs,CODEC_PALETTE);
 
     // controlWindowImageInfo = ControlWindowImageInfo::getInfo(hostName, port);
     // assert(controlWindowImageInfo);
@@ -111,7 +422,11 @@ namespace dw2 {
 	  std::cout << "dw2.client: connecting to remote: " << remote.hostName << ":" << remote.port << "\n";
 	}
     // std::cout << "#dw2.client(" << dbg_rank << "): starting socket group to display service" << "\n";
-    serviceSockets = std::make_shared<SocketGroup>(serviceInfo->magic,numPeers,remotes);
+    rateController = std::make_shared<RateController>((int)serviceInfo->nodes.size());
+    // tiles that queue up for the same display go out as one
+    // container each, rather than one message (and syscall) per tile
+    serviceSockets = std::make_shared<SocketGroup>(serviceInfo->magic,numPeers,remotes,
+                                                   std::make_shared<TilePacker>());
     // std::cout << "#dw2.client(" << dbg_rank << "): connection established... waiting for handshake" << "\n";
     // ------------------------------------------------------------------
     // and do 'soft barrier' by reading one 'welcome' message from
@@ -130,6 +445,13 @@ namespace dw2 {
       //          << "/" << serviceSockets->remotes.size() << " for frame " << *(int*)token->data() << "\n";
     }
 
+    // (only start threads once nothing can throw any more - a
+    // constructor that throws with threads running terminates us)
+    for (auto &ct : compressorThreads)
+      ct = std::thread([this](){this->compressorThreadFunc();});
+    // the refiner needs the sockets, and the refinement codec
+    refinerThread = std::thread([this](){this->refinerThreadFunc();});
+
     // // ------------------------------------------------------------------
     // // done ...
     // // ------------------------------------------------------------------
@@ -181,11 +503,16 @@ namespace dw2 {
 
   extern "C" dw2_rc dw2_connect(const char *hostName, int port, int numPeers)
   {
-    // if(master){
-    //   m_client = std::make_shared<Client>(hostName,port,numPeers, master, 1);
-    // }else{
-      g_client = std::make_shared<Client>(hostName,port,numPeers);
-    // }
+    try {
+      // if(master){
+      //   m_client = std::make_shared<Client>(hostName,port,numPeers, master, 1);
+      // }else{
+        g_client = std::make_shared<Client>(hostName,port,numPeers);
+      // }
+    } catch (const std::exception &e) {
+        std::cout << e.what() << "\n";
+        return DW2_ERROR;
+    }
     return DW2_OK;
   }
   
@@ -228,9 +555,24 @@ namespace dw2 {
     
     
     g_frameID++;
+    g_client->rateController->endFrame(g_client->serviceSockets->remotes);
+    // tiles of the frame we just ended may still be waiting for a
+    // compressor, and those still need the frame before
+    g_client->pruneSentTiles(g_frameID-2);
+    g_client->references->prune(g_frameID-2);
     //std::cout << "#dw2.client(" << dbg_rank << "): end_frame: next frame id is " << g_frameID << "\n";
   }
 
+  /*! render the following frames at 1/scale of the wall's native
+      resolution; see dw2_client.h */
+  extern "C" dw2_rc dw2_set_render_scale(int scale)
+  {
+    if (!g_client || scale < 1)
+      return DW2_ERROR;
+    g_client->renderScale = scale;
+    return DW2_OK;
+  }
+  
   /*! send a tile that goes to position (x0,y0) and has size (sizeX,
       sizeY), with given array of pixels. */
   extern "C" void dw2_send_rgba(int x0, int y0, int sizeX, int sizeY,
@@ -240,15 +582,12 @@ namespace dw2 {
                      const uint32_t *pixel)
   {
 #if 1
-    PlainTile::SP tile = std::make_shared<PlainTile>();
-    tile->alloc(box2i(vec2i(x0,y0),vec2i(x0+sizeX,y0+sizeY)),0);
-    tile->frameID = g_frameID;
-    uint32_t *out = (uint32_t *)tile->pixels.data();
-    for (int iy=0;iy<sizeY;iy++) {
-      const uint32_t *in = pixel + iy * pitch;
-      for (int ix=0;ix<sizeX;ix++)
-        *out++ = *in++;
-    }
+    PlainTile::SP tile
+      = g_client->tilePool.get(box2i(vec2i(x0,y0),vec2i(x0+sizeX,y0+sizeY)),0,g_frameID);
+    tile->scale = g_client->renderScale;
+    // no streaming stores: the tile gets encoded right away, so we
+    // want its pixels in the cache
+    blit(tile->pixels,tile->region,tile->pitch,pixel,tile->region,pitch,false);
     g_client->put(tile);
 #else
     // ------------------------------------------------------------------
@@ -257,7 +596,7 @@ namespace dw2 {
     PlainTile tile;
     tile.alloc(box2i(vec2i(x0,y0),vec2i(x0+sizeX,y0+sizeY)),0);
     tile.frameID = g_frameID;
-    uint32_t *out = (uint32_t *)tile.pixels.data();
+    uint32_t *out = (uint32_t *)tile.pixels;
     for (int iy=0;iy<sizeY;iy++) {
       const uint32_t *in = pixel + iy * pitch;
       for (int ix=0;ix<sizeX;ix++)
@@ -276,5 +615,152 @@ namespace dw2 {
 #endif
   }
 
+  /*! send a tile with pixels in any of the formats in dw2_format_t;
+      see dw2_client.h */
+  extern "C" dw2_rc dw2_send_tile(dw2_format_t format, int flags,
+                                  int x0, int y0, int sizeX, int sizeY,
+                                  int pitchInBytes,
+                                  const void *pixel)
+  {
+    if (!isValidFormat(format)) {
+      std::cout << "dw2_send_tile: unknown pixel format #" << (int)format << "\n";
+      return DW2_ERROR;
+    }
+    PlainTile::SP tile
+      = g_client->tilePool.get(box2i(vec2i(x0,y0),vec2i(x0+sizeX,y0+sizeY)),0,g_frameID);
+    tile->scale = g_client->renderScale;
+    const bool srgb = flags & DW2_SRGB_ENCODE;
+    for (int iy=0;iy<sizeY;iy++)
+      convertRow(tile->pixels+iy*tile->pitch,
+                 (const uint8_t*)pixel+iy*size_t(pitchInBytes),
+                 sizeX,format,srgb);
+    g_client->put(tile);
+    return DW2_OK;
+  }
+
+  /*! encode all following tiles with the given codec; see
+      dw2_client.h */
+  extern "C" dw2_rc dw2_set_codec(dw2_codec_t codec)
+  {
+    if (!g_client)
+      return DW2_ERROR;
+    const std::vector<int> &serviceCodecs = g_client->serviceInfo->codecs;
+    const std::vector<int>  clientCodecs  = supportedCodecs();
+    if (!isGeneralCodec(codec)
+        || !contains(serviceCodecs,codec)
+        || !contains(clientCodecs,codec))
+      return DW2_ERROR;
+    g_client->codec = codec;
+    return DW2_OK;
+  }
+
+  /*! let the client adapt encoding quality per display link to hit
+      given frame rate and/or per-link bandwidth; see dw2_client.h */
+  extern "C" dw2_rc dw2_set_rate_target(float framesPerSecond,
+                                        float megaBytesPerSecondPerLink)
+  {
+    if (!g_client || framesPerSecond < 0.f || megaBytesPerSecondPerLink < 0.f)
+      return DW2_ERROR;
+    g_client->rateController->setTargets(framesPerSecond,
+                                         megaBytesPerSecondPerLink*1e6);
+    return DW2_OK;
+  }
+
+  /*! number of display links; see dw2_client.h */
+  extern "C" int dw2_num_links()
+  {
+    return g_client ? g_client->rateController->numLinks() : 0;
+  }
+
+  /*! what the client currently does on given display link; see
+      dw2_client.h */
+  extern "C" dw2_rc dw2_get_link_stats(int linkID, dw2_link_stats_t *stats)
+  {
+    if (!g_client || !stats
+        || linkID < 0 || linkID >= g_client->rateController->numLinks())
+      return DW2_ERROR;
+    const RateController::LinkStats linkStats
+      = g_client->rateController->getStats(linkID);
+    stats->quality = linkStats.params.quality;
+    switch (linkStats.params.subsampling) {
+    case EncodeParams::CHROMA_444: stats->chromaSubsampling = 444; break;
+    case EncodeParams::CHROMA_422: stats->chromaSubsampling = 422; break;
+    default:                       stats->chromaSubsampling = 420; break;
+    }
+    stats->bytesPerFrame      = (float)linkStats.bytesPerFrame;
+    stats->megaBytesPerSecond = (float)(linkStats.bytesPerSecond*1e-6);
+    return DW2_OK;
+  }
+  
+  /*! encode tiles at a quality that depends on how far they are
+      from the given regions; see dw2_client.h */
+  extern "C" dw2_rc dw2_set_regions_of_interest(const dw2_region_t *regions,
+                                                int count, int falloff)
+  {
+    if (!g_client || count < 0 || (count > 0 && !regions) || falloff < 0)
+      return DW2_ERROR;
+    std::vector<box2i> rois(count);
+    for (int i=0;i<count;i++)
+      rois[i] = box2i(vec2i(regions[i].x0,regions[i].y0),
+                      vec2i(regions[i].x0+regions[i].sizeX,
+                            regions[i].y0+regions[i].sizeY));
+    g_client->rateController->setRegionsOfInterest(rois,falloff);
+    return DW2_OK;
+  }
+  
+  /*! send 'count' tiles at once; see dw2_client.h */
+  extern "C" dw2_rc dw2_send_tiles(const dw2_tile_t *tiles, int count)
+  {
+    if (count <= 0) return DW2_OK;
+    for (int i=0;i<count;i++)
+      if (!isValidFormat(tiles[i].format)) {
+        std::cout << "dw2_send_tiles: tile #" << i << " has unknown pixel format #"
+                  << (int)tiles[i].format << "\n";
+        return DW2_ERROR;
+      }
+    
+    std::vector<box2i> regions(count);
+    for (int i=0;i<count;i++)
+      regions[i] = box2i(vec2i(tiles[i].x0,tiles[i].y0),
+                         vec2i(tiles[i].x0+tiles[i].sizeX,
+                               tiles[i].y0+tiles[i].sizeY));
+    std::vector<PlainTile::SP> plainTiles(count);
+    g_client->tilePool.get(plainTiles.data(),regions.data(),count,0,g_frameID);
+
+    for (int i=0;i<count;i++) {
+      const dw2_tile_t &in  = tiles[i];
+      PlainTile        &out = *plainTiles[i];
+      out.scale = g_client->renderScale;
+      for (int iy=0;iy<in.sizeY;iy++)
+        convertRow(out.pixels+iy*out.pitch,
+                   (const uint8_t*)in.pixel+iy*size_t(in.pitchInBytes),
+                   in.sizeX,in.format,in.flags & DW2_SRGB_ENCODE);
+    }
+    g_client->put(plainTiles.data(),count);
+    return DW2_OK;
+  }
+
+  /*! map a tile that goes to position (x0,y0) and has size (sizeX,
+      sizeY); see dw2_client.h */
+  extern "C" uint32_t *dw2_map_tile(int x0, int y0, int sizeX, int sizeY,
+                                    int *pitch)
+  {
+    PlainTile::SP tile
+      = g_client->mapTile(box2i(vec2i(x0,y0),vec2i(x0+sizeX,y0+sizeY)));
+    *pitch = tile->pitch;
+    return tile->pixels;
+  }
+
+  /*! send a tile previously mapped with dw2_map_tile() */
+  extern "C" dw2_rc dw2_commit_tile(uint32_t *pixel)
+  {
+    if (!g_client)
+      return DW2_ERROR;
+    if (!g_client->commitTile(pixel)) {
+      std::cout << "dw2_commit_tile: pixels do not belong to any mapped tile" << "\n";
+      return DW2_ERROR;
+    }
+    return DW2_OK;
+  }
   
 } // ::dw2
@@ -33,6 +33,48 @@ extern "C" {
 
   typedef enum { DW2_OK = 0, DW2_ERROR } dw2_rc;
 
+  /*! pixel formats dw2_send_tile() accepts; all get converted to
+      8-bit RGBA on the way into the send buffer */
+  typedef enum {
+    /*! 8-bit RGBA, R in the lowest byte - what dw2_send_rgba() takes */
+    DW2_FORMAT_RGBA8 = 0,
+    /*! 8-bit BGRA, B in the lowest byte */
+    DW2_FORMAT_BGRA8,
+    /*! 8-bit RGB, three bytes per pixel; alpha becomes 255 */
+    DW2_FORMAT_RGB8,
+    /*! four 32-bit floats per pixel, clamped to [0,1] */
+    DW2_FORMAT_RGBA32F,
+    /*! four 16-bit (IEEE half) floats per pixel, clamped to [0,1] */
+    DW2_FORMAT_RGBA16F
+  } dw2_format_t;
+
+  /*! flags for dw2_send_tile() */
+  typedef enum {
+    /*! input is linear; sRGB-encode the color channels (not alpha) */
+    DW2_SRGB_ENCODE = 1
+  } dw2_format_flags_t;
+
+  /*! how tiles get encoded on their way to the displays; see
+      dw2_set_codec() */
+  typedef enum {
+    /*! uncompressed pixels */
+    DW2_CODEC_PLAIN = 0,
+    /*! jpeg; only there if client and service are built with it */
+    DW2_CODEC_JPEG,
+    /*! lossless compression that is pixel-exact, but much faster
+        than jpeg; for fast links, and images where jpeg artifacts
+        are not acceptable */
+    DW2_CODEC_LOSSLESS,
+    /*! lossless, too, but encodes tiles relative to what the same
+        region showed in the previous frame where that pays off; for
+        content that changes only a little from frame to frame */
+    DW2_CODEC_TEMPORAL,
+    /*! lossy, fixed-rate block compression at 4 bits per pixel (as
+        in BC1/DXT1 textures); much cheaper to decode than jpeg, and
+        every frame takes the same bandwidth, whatever the content */
+    DW2_CODEC_BLOCK
+  } dw2_codec_t;
+
   /*! query information on that given address; can be done as often as
       desired before connecting, and does not require a connect. This
       allows an app to query the vailability and/or size of a wall
@@ -55,6 +97,65 @@ extern "C" {
   
   void dw2_end_frame();
 
+  /*! render the following frames at 1/scale of the wall's native
+      resolution along each axis (1 = native, 2 = half, 4 = quarter,
+      ...); the displays upscale to native resolution. From then on,
+      all tile coordinates refer to a wall of
+      ceil(totalPixelsInWall/scale) pixels. Call between frames. */
+  dw2_rc dw2_set_render_scale(int scale);
+  
+  /*! encode all following tiles with the given codec; fails if
+      either the client or the service does not support it. By
+      default, the client uses jpeg where available, and temporal
+      otherwise. Unless the codec is plain, tiles that are all one
+      color, or have only a few colors, get sent with (lossless)
+      codecs of their own instead. */
+  dw2_rc dw2_set_codec(dw2_codec_t codec);
+  
+  /*! let the client pick (jpeg) quality and chroma subsampling for
+      every display link on its own, once per frame, such that each
+      link's traffic fits the given frame rate and/or the given
+      bandwidth per link; 0 means 'no target' for either. With no
+      target at all (the default), quality stays fixed. */
+  dw2_rc dw2_set_rate_target(float framesPerSecond,
+                             float megaBytesPerSecondPerLink);
+
+  /*! what the client currently does on one display link */
+  struct dw2_link_stats_t {
+    /*! jpeg quality, 1..100 */
+    int32_t quality;
+    /*! 444, 422, or 420 */
+    int32_t chromaSubsampling;
+    /*! (smoothed) encoded bytes per frame */
+    float   bytesPerFrame;
+    /*! (smoothed) measured bandwidth; 0 if not known (yet) */
+    float   megaBytesPerSecond;
+  };
+
+  /*! number of display links, ie, of valid 'linkID's for
+      dw2_get_link_stats() */
+  int dw2_num_links();
+
+  /*! query what the client currently does on given display link */
+  dw2_rc dw2_get_link_stats(int linkID, struct dw2_link_stats_t *stats);
+
+  /*! a region of the wall, in the same coordinates as tiles */
+  struct dw2_region_t {
+    int32_t x0, y0, sizeX, sizeY;
+  };
+
+  /*! tell the client where the viewers look (eg, from head tracking,
+      or a presenter's pointer): tiles that overlap any of the given
+      regions get encoded at top quality, all others at their link's
+      quality (see dw2_set_rate_target()), lowered more and more the
+      further away from the closest region they are, down to the
+      lowest quality the client ever uses at 'falloff' pixels away and
+      beyond. Only matters for codecs that have a quality to pick
+      (ie, jpeg). Applies to all tiles encoded from now on, so call
+      it before sending a frame's tiles; 'count' 0 turns it off. */
+  dw2_rc dw2_set_regions_of_interest(const struct dw2_region_t *regions,
+                                     int count, int falloff);
+  
   /*! send a tile that goes to position (x0,y0) and has size (sizeX,
       sizeY), with given array of pixels. */
   void dw2_send_rgba(int x0, int y0, int sizeX, int sizeY,
@@ -63,7 +164,90 @@ extern "C" {
                      int pitch,
                      const uint32_t *pixel);
 
+  /*! send a tile that goes to position (x0,y0) and has size (sizeX,
+      sizeY), with given array of pixels in given format; 'flags' is
+      a combination of dw2_format_flags_t. Conversion happens right
+      while copying into the send buffer, so this is no more expensive
+      than dw2_send_rgba() with pre-converted pixels. Returns
+      DW2_ERROR (and sends nothing) for an unknown format. */
+  dw2_rc dw2_send_tile(dw2_format_t format, int flags,
+                     int x0, int y0, int sizeX, int sizeY,
+                     /*! pitch: the increment (in bytes!) between each
+                         line and the next in the pixel[] array */
+                     int pitchInBytes,
+                     const void *pixel);
+
+  /*! one tile for dw2_send_tiles(); same meaning as the parameters
+      of dw2_send_tile(). A zero-initialized tile has format
+      DW2_FORMAT_RGBA8 and no flags. */
+  struct dw2_tile_t {
+    int32_t      x0, y0, sizeX, sizeY;
+    /*! increment (in bytes) between one line and the next */
+    int32_t      pitchInBytes;
+    dw2_format_t format;
+    int32_t      flags;
+    const void  *pixel;
+  };
+
+  /*! send 'count' tiles at once; that is the same as calling
+      dw2_send_tile() for each of them, but only pays the per-tile
+      bookkeeping (pool and queue locks, waking up the encoders) once
+      per batch. Returns DW2_ERROR (and sends none of them) if any
+      tile has an unknown format */
+  dw2_rc dw2_send_tiles(const struct dw2_tile_t *tiles, int count);
+
+  /*! map a tile that goes to position (x0,y0) and has size (sizeX,
+      sizeY): returns pixel memory owned by the client library that
+      the app can render into directly (without any additional copy),
+      and writes that memory's pitch (in uints) to 'pitch'. The tile
+      gets sent once the app passes the returned pointer to
+      dw2_commit_tile(). */
+  uint32_t *dw2_map_tile(int x0, int y0, int sizeX, int sizeY,
+                         int *pitch);
+
+  /*! send a tile previously mapped with dw2_map_tile(); 'pixel' has
+      to be the pointer that dw2_map_tile() returned. After this call
+      the app may no longer touch that memory. Returns DW2_ERROR
+      (and sends nothing) if 'pixel' is not a mapped tile's */
+  dw2_rc dw2_commit_tile(uint32_t *pixel);
   
 #ifdef __cplusplus
 }
 #endif
+
+#ifdef __cplusplus
+namespace dw2 {
+
+  /*! c++ convenience wrapper for dw2_send_tiles(), for any
+      contiguous container of tiles (std::vector, std::array, ...) */
+  template<typename TileContainer>
+  inline dw2_rc sendTiles(const TileContainer &tiles)
+  { return dw2_send_tiles(tiles.data(),(int)tiles.size()); }
+
+  /*! same, for a [begin,end) range of tiles */
+  inline dw2_rc sendTiles(const dw2_tile_t *begin, const dw2_tile_t *end)
+  { return dw2_send_tiles(begin,int(end-begin)); }
+  
+  /*! c++ wrapper for dw2_map_tile()/dw2_commit_tile(): maps the tile
+      upon construction, and commits it when going out of scope */
+  struct MappedTile {
+    MappedTile(int x0, int y0, int sizeX, int sizeY)
+      : pixel(dw2_map_tile(x0,y0,sizeX,sizeY,&pitch))
+    {}
+    ~MappedTile() { commit(); }
+    
+    MappedTile(const MappedTile &) = delete;
+    MappedTile &operator=(const MappedTile &) = delete;
+
+    /*! send the tile right away; no-op if already committed */
+    void commit() { if (pixel) dw2_commit_tile(pixel); pixel = nullptr; }
+    
+    /*! pointer to the first pixel of line 'y' (relative to the tile) */
+    uint32_t *line(int y) const { return pixel + y*pitch; }
+    
+    uint32_t *pixel;
+    int       pitch;
+  };
+  
+} // ::dw2
+#endif
@@ -0,0 +1,102 @@
+// ======================================================================== //
+// Copyright 2019 Ingo Wald                                                 //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "Blit.h"
+#if defined(__SSE2__) || defined(_M_X64)
+# include <emmintrin.h>
+# define DW2_SSE2 1
+#endif
+
+namespace dw2 {
+
+  /*! rows at least this many pixels wide get written with
+      non-temporal stores: they are too big to be worth keeping in
+      the caches for whoever reads them next, and streaming them saves
+      reading every destination line before overwriting it. Narrower
+      rows (eg, those of a typical tile that gets encoded right after
+      the copy) are better off with plain memcpy */
+  static const int minStreamingWidth = 1024;
+  
+#if DW2_SSE2
+  /*! copy one row of 'width' pixels with non-temporal stores */
+  static inline void streamRow(uint32_t *out, const uint32_t *in, int width)
+  {
+    int x = 0;
+    // only ever stream whole cache lines: a line that gets written
+    // partly with streaming and partly with regular stores costs
+    // more than writing all of it the regular way
+    const int head = std::min(width,int((64 - (size_t(out) & 63)) & 63) / 4);
+    if (size_t(out) & 3) {
+      // not even pixel-aligned - nothing to stream
+      memcpy(out,in,width*sizeof(uint32_t));
+      return;
+    }
+    memcpy(out,in,head*sizeof(uint32_t));
+    x = head;
+    for (;x+16<=width;x+=16) {
+      const __m128i a = _mm_loadu_si128((const __m128i*)(in+x+ 0));
+      const __m128i b = _mm_loadu_si128((const __m128i*)(in+x+ 4));
+      const __m128i c = _mm_loadu_si128((const __m128i*)(in+x+ 8));
+      const __m128i d = _mm_loadu_si128((const __m128i*)(in+x+12));
+      _mm_stream_si128((__m128i*)(out+x+ 0),a);
+      _mm_stream_si128((__m128i*)(out+x+ 4),b);
+      _mm_stream_si128((__m128i*)(out+x+ 8),c);
+      _mm_stream_si128((__m128i*)(out+x+12),d);
+    }
+    memcpy(out+x,in+x,(width-x)*sizeof(uint32_t));
+  }
+#endif
+  
+  /*! copy the pixels of a source image that fall into the region of
+    a destination image */
+  size_t blit(uint32_t *dst, const box2i &dstRegion, int dstPitch,
+              const uint32_t *src, const box2i &srcRegion, int srcPitch,
+              bool streaming)
+  {
+    if (!dstRegion.overlaps(srcRegion))
+      return 0;
+    const box2i region = intersectionOf(dstRegion,srcRegion);
+    const vec2i size   = region.size();
+    
+    uint32_t *out
+      = dst
+      + (region.lower.x-dstRegion.lower.x)
+      + dstPitch * size_t(region.lower.y-dstRegion.lower.y);
+    const uint32_t *in
+      = src
+      + (region.lower.x-srcRegion.lower.x)
+      + srcPitch * size_t(region.lower.y-srcRegion.lower.y);
+
+#if DW2_SSE2
+    if (streaming && size.x >= minStreamingWidth) {
+      for (int iy=0;iy<size.y;iy++)
+        streamRow(out+iy*size_t(dstPitch),in+iy*size_t(srcPitch),size.x);
+      // make the streamed pixels visible to whoever looks at them
+      // next, same as regular stores would be
+      _mm_sfence();
+      return size.product();
+    }
+#endif
+    if (dstPitch == size.x && srcPitch == size.x)
+      // both contiguous - one copy will do
+      memcpy(out,in,size.product()*sizeof(uint32_t));
+    else
+      for (int iy=0;iy<size.y;iy++)
+        memcpy(out+iy*size_t(dstPitch),in+iy*size_t(srcPitch),size.x*sizeof(uint32_t));
+    return size.product();
+  }
+  
+} // ::dw2
@@ -0,0 +1,37 @@
+// ======================================================================== //
+// Copyright 2019 Ingo Wald                                                 //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "vec.h"
+
+namespace dw2 {
+
+  /*! copy the pixels of a source image that fall into the region of
+      a destination image: 'src' covers 'srcRegion', 'dst' covers
+      'dstRegion', both in the same (eg, global wall) coordinates, and
+      each has rows 'pitch' pixels apart. The regions get intersected
+      once, and whatever lies outside the destination gets skipped.
+      Unless 'streaming' is off, wide rows get written with
+      non-temporal stores, so that copying into a frame buffer does
+      not push everything else out of the caches; turn it off when the
+      copy gets read again right away. Returns the number of pixels
+      copied */
+  size_t blit(uint32_t *dst, const box2i &dstRegion, int dstPitch,
+              const uint32_t *src, const box2i &srcRegion, int srcPitch,
+              bool streaming = true);
+  
+} // ::dw2
@@ -15,32 +15,461 @@
 // ======================================================================== //
 
 #include "CompressedTile.h"
+#include "Hash.h"
+#include "LZ.h"
+#include "Blit.h"
 #include <atomic>
 
+#if defined(__SSE2__) || defined(_M_X64)
+# include <emmintrin.h>
+# define DW2_SSE2 1
+#endif
+
 #if TURBO_JPEG
 #include "turbojpeg.h"
 // # include "jpeglib.h"
-#define JPEG_QUALITY 75
-//100
 #endif
 
 namespace dw2 {
 
+  /*! (re-)allocate pixel storage for given region. The previous
+    storage gets re-used if nobody else still holds on to it;
+    otherwise, we get a new one from the pool (if provided) */
+  void PlainTile::alloc(const box2i &region, int eye, MessagePool *pool)
+  {
+    const size_t numBytes = storageSize(region);
+    // a storage message that somebody else still holds on to (eg,
+    // because a plain encoder handed it to the network) must not
+    // get touched any more; the pool it came from doesn't count
+    if (storage && storage.use_count() == (storage->pooled ? 2 : 1))
+      storage->resize(numBytes);
+    else if (pool)
+      storage = pool->get(numBytes);
+    else {
+      storage = std::make_shared<Mailbox::Message>();
+      storage->resize(numBytes);
+    }
+    attach(region,eye,storage);
+  }
+
+  /*! use the given message as pixel storage for given region */
+  void PlainTile::attach(const box2i &region, int eye, Mailbox::Message::SP storage)
+  {
+    assert(storage->size() >= storageSize(region));
+    this->region  = region;
+    this->eye     = eye;
+    this->pitch   = region.size().x;
+    this->storage = storage;
+    pixels = (uint32_t*)(storage->data()+sizeof(TileMessageDataHeader));
+  }
+
+  /*! size of a message that can hold the pixels for given region */
+  size_t PlainTile::storageSize(const box2i &region)
+  {
+    return
+      sizeof(TileMessageDataHeader)
+      + sizeof(uint32_t)*region.size().product();
+  }
+
+  /*! a tile that refers to the given sub-region of this tile's
+    pixels (without copying them) */
+  PlainTile PlainTile::subTile(const box2i &subRegion) const
+  {
+    assert(region.contains(subRegion));
+    if (subRegion.lower == region.lower && subRegion.upper == region.upper)
+      return *this;
+    
+    PlainTile sub;
+    sub.region  = subRegion;
+    sub.pitch   = pitch;
+    sub.eye     = eye;
+    sub.frameID = frameID;
+    sub.scale   = scale;
+    const vec2i ofs = subRegion.lower - region.lower;
+    sub.pixels  = pixels + ofs.x + ofs.y * pitch;
+    // 'storage' stays empty - the sub-tile's pixels are not laid out
+    // the way a message needs them
+    return sub;
+  }
+
+  /*! fill in the header fields that describe the tile itself */
+  static void writeHeader(TileMessageDataHeader *header,
+                          const PlainTile &tile,
+                          int codec,
+                          int flags = 0)
+  {
+    header->frameID = tile.frameID;
+    header->region  = tile.region;
+    header->eye     = tile.eye;
+    header->flags   = flags;
+    header->scale   = tile.scale;
+    header->codec   = codec;
+  }
+
+  /*! the reverse of writeHeader() */
+  static void readHeader(PlainTile &tile,
+                         const TileMessageDataHeader *header)
+  {
+    tile.frameID = header->frameID;
+    tile.region  = header->region;
+    tile.eye     = header->eye;
+    tile.scale   = header->scale;
+  }
+
+  /*! whether the caller has pointed 'tile' to pixels of somebody
+      else's (eg, a frame buffer's) for exactly the given message's
+      region, for a decoder to write into */
+  static inline bool hasTarget(const PlainTile &tile,
+                               const TileMessageDataHeader *header)
+  {
+    return
+      tile.pixels && !tile.storage
+      && tile.region.lower == header->region.lower
+      && tile.region.upper == header->region.upper;
+  }
+
+  /*! get 'tile' ready for decoding the given message into: the
+      caller's target pixels if it has set any (see hasTarget()),
+      else storage of the tile's own */
+  static void prepareToDecode(PlainTile &tile,
+                              const TileMessageDataHeader *header)
+  {
+    if (!hasTarget(tile,header))
+      tile.alloc(header->region,header->eye);
+    readHeader(tile,header);
+  }
+  
+  /*! a fast 64-bit hash of this tile's pixels */
+  uint64_t PlainTile::hash() const
+  {
+    const vec2i size = this->size();
+    Hash64 hasher;
+    if (pitch == size.x)
+      hasher.add(pixels,sizeof(uint32_t)*size.product());
+    else
+      for (int iy=0;iy<size.y;iy++)
+        hasher.add(pixels+iy*pitch,sizeof(uint32_t)*size.x);
+    return hasher.get();
+  }
+
+  /*! create the (pixel-less) message that tells the display that
+    given tile is the same as in the previous frame */
+  Mailbox::Message::SP makeUnchangedTileMessage(const PlainTile &tile)
+  {
+    Mailbox::Message::SP message = std::make_shared<Mailbox::Message>();
+    message->resize(sizeof(TileMessageDataHeader));
+    writeHeader((TileMessageDataHeader*)message->data(),tile,
+                CODEC_PLAIN,TileMessageDataHeader::UNCHANGED);
+    return message;
+  }
+  
+  /*! look up the reference for given tile's region, and return it
+    in 'reference' if it is from frame 'frameID' */
+  bool ReferenceTiles::get(const PlainTile &tile, int frameID, PlainTile &reference)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = tiles.find(keyOf(tile.region,tile.eye,tile.scale));
+    if (it == tiles.end())
+      return false;
+    auto frame = it->second.find(frameID);
+    if (frame == it->second.end())
+      return false;
+    reference = frame->second;
+    return true;
+  }
+
+  /*! make given tile the reference for its region in its frame */
+  void ReferenceTiles::set(const PlainTile &tile)
+  {
+    assert(tile.storage);
+    std::lock_guard<std::mutex> lock(mutex);
+    tiles[keyOf(tile.region,tile.eye,tile.scale)][tile.frameID] = tile;
+  }
+
+  /*! the tile for given region in frame 'frameID' is the same as in
+    the frame before */
+  void ReferenceTiles::touch(const box2i &region, int eye, int scale, int frameID)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = tiles.find(keyOf(region,eye,scale));
+    if (it == tiles.end())
+      return;
+    auto before = it->second.find(frameID-1);
+    if (before == it->second.end())
+      return;
+    // (shares the pixels of the one before)
+    PlainTile &reference = it->second[frameID];
+    reference         = before->second;
+    reference.frameID = frameID;
+  }
+
+  /*! forget about all references older than the given frame */
+  void ReferenceTiles::prune(int oldestFrameID)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = tiles.begin(); it != tiles.end(); ) {
+      std::map<int,PlainTile> &frames = it->second;
+      frames.erase(frames.begin(),frames.lower_bound(oldestFrameID));
+      if (frames.empty())
+        it = tiles.erase(it);
+      else
+        ++it;
+    }
+  }
+  
+  /*! get a tile for given region, with storage already allocated */
+  PlainTile::SP PlainTilePool::get(const box2i &region, int eye, int frameID)
+  {
+    PlainTile::SP tile;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!freeTiles.empty()) {
+        tile = freeTiles.back();
+        freeTiles.pop_back();
+      }
+    }
+    if (!tile)
+      tile = std::make_shared<PlainTile>();
+    tile->alloc(region,eye,&storage);
+    tile->frameID = frameID;
+    return tile;
+  }
+
+  /*! get 'count' tiles at once, one for each of the given regions */
+  void PlainTilePool::get(PlainTile::SP *tiles, const box2i *regions, size_t count,
+                          int eye, int frameID)
+  {
+    size_t numRecycled = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      numRecycled = std::min(count,freeTiles.size());
+      for (size_t i=0;i<numRecycled;i++) {
+        tiles[i] = freeTiles.back();
+        freeTiles.pop_back();
+      }
+    }
+    for (size_t i=numRecycled;i<count;i++)
+      tiles[i] = std::make_shared<PlainTile>();
+
+    std::vector<size_t>               sizes(count);
+    std::vector<Mailbox::Message::SP> messages(count);
+    for (size_t i=0;i<count;i++)
+      sizes[i] = PlainTile::storageSize(regions[i]);
+    storage.get(messages.data(),sizes.data(),count);
+    for (size_t i=0;i<count;i++) {
+      tiles[i]->attach(regions[i],eye,messages[i]);
+      tiles[i]->frameID = frameID;
+    }
+  }
+
+  /*! get 'count' tiles that refer to the given sub-regions of
+    'tile's pixels */
+  void PlainTilePool::getSubTiles(PlainTile::SP *subTiles, const PlainTile &tile,
+                                  const box2i *subRegions, size_t count)
+  {
+    size_t numRecycled = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      numRecycled = std::min(count,freeTiles.size());
+      for (size_t i=0;i<numRecycled;i++) {
+        subTiles[i] = freeTiles.back();
+        freeTiles.pop_back();
+      }
+    }
+    for (size_t i=numRecycled;i<count;i++)
+      subTiles[i] = std::make_shared<PlainTile>();
+    for (size_t i=0;i<count;i++) {
+      *subTiles[i] = tile.subTile(subRegions[i]);
+      subTiles[i]->storage = tile.storage;
+    }
+  }
+
+  /*! give a tile back to the pool */
+  void PlainTilePool::release(PlainTile::SP tile)
+  {
+    // a sub-tile (eg, a slice of a bigger tile) only holds on to the
+    // storage of the tile it is part of, which can go back to the
+    // pool as soon as all sub-tiles are done with it
+    if (tile->storage && tile->storage->size() != PlainTile::storageSize(tile->region))
+      tile->storage = nullptr;
+    std::lock_guard<std::mutex> lock(mutex);
+    freeTiles.push_back(tile);
+  }
+  
+  
+  /*! whether 'next' may go into the same container as 'first' */
+  bool TilePacker::canPack(const Mailbox::Message &first,
+                           const Mailbox::Message &next)
+  {
+    // the display's mailbox sorts messages by frame, so a container
+    // may only hold tiles of a single frame - or only refinements,
+    // which do not belong to any frame being assembled
+    if (isRefinement(first) || isRefinement(next))
+      return isRefinement(first) && isRefinement(next);
+    return
+      ((const TileMessageDataHeader *)first.data())->frameID
+      ==
+      ((const TileMessageDataHeader *)next.data())->frameID;
+  }
+
+  /*! offsets of the tiles in a container are aligned to this, so
+      the pixels in a plain tile can be used in place */
+  static const size_t packedTileAlignment = 8;
+
+  static inline size_t alignedOffset(size_t offset)
+  {
+    return divRoundUp(offset,packedTileAlignment)*packedTileAlignment;
+  }
+
+  /*! where the first packed tile's size goes, right behind the
+      container's header and its number of tiles */
+  static inline size_t firstPackedTileOffset()
+  {
+    return alignedOffset(sizeof(TileMessageDataHeader)+sizeof(uint32_t));
+  }
+  
+  /*! append the pieces a container of the given tile messages
+    consists of, in order, to 'pieces': the container's own bytes
+    (its header, and every tile's size and padding) go into
+    'framing', the tiles themselves get referred to, not copied */
+  static void gatherPackedTiles(const uint8_t *const *tiles,
+                                const size_t *sizes,
+                                size_t numTiles,
+                                std::vector<uint8_t>      &framing,
+                                std::vector<const void *> &pieces,
+                                std::vector<size_t>       &pieceSizes)
+  {
+    assert(numTiles > 0);
+    box2i bounds;
+    for (size_t i=0;i<numTiles;i++) {
+      const box2i region = ((const TileMessageDataHeader *)tiles[i])->nativeRegion();
+      bounds = box2i(min(bounds.lower,region.lower),max(bounds.upper,region.upper));
+    }
+
+    // every tile comes with its size, and less than one alignment's
+    // worth of padding
+    framing.assign(firstPackedTileOffset()+numTiles*2*packedTileAlignment,0);
+    TileMessageDataHeader *header = (TileMessageDataHeader *)framing.data();
+    header->frameID = ((const TileMessageDataHeader *)tiles[0])->frameID;
+    header->region  = bounds;
+    header->eye     = 0;
+    header->flags
+      = TileMessageDataHeader::CONTAINER
+      | (((const TileMessageDataHeader *)tiles[0])->flags & TileMessageDataHeader::REFINEMENT);
+    header->scale   = 1;
+    header->codec   = CODEC_PLAIN;
+    *(uint32_t *)(header+1) = numTiles;
+
+    /*! framing bytes up to here are in pieces already */
+    size_t framingBegin = 0;
+    size_t framingEnd   = firstPackedTileOffset();
+    /*! where we are in the container */
+    size_t offset       = firstPackedTileOffset();
+    for (size_t i=0;i<numTiles;i++) {
+      const uint64_t size = sizes[i];
+      memcpy(framing.data()+framingEnd,&size,sizeof(size));
+      framingEnd += packedTileAlignment;
+      pieces.push_back(framing.data()+framingBegin);
+      pieceSizes.push_back(framingEnd-framingBegin);
+      framingBegin = framingEnd;
+      offset += packedTileAlignment;
+      
+      pieces.push_back(tiles[i]);
+      pieceSizes.push_back(sizes[i]);
+      const size_t padding = alignedOffset(offset+sizes[i]) - (offset+sizes[i]);
+      framingEnd += padding;
+      offset     += sizes[i] + padding;
+    }
+    if (framingEnd > framingBegin) {
+      pieces.push_back(framing.data()+framingBegin);
+      pieceSizes.push_back(framingEnd-framingBegin);
+    }
+  }
+  
+  /*! pack the given tile messages (all of the same frame) into one
+    container message */
+  Mailbox::Message::SP packTiles(const uint8_t *const *tiles,
+                                 const size_t *sizes,
+                                 size_t numTiles)
+  {
+    std::vector<uint8_t>      framing;
+    std::vector<const void *> pieces;
+    std::vector<size_t>       pieceSizes;
+    gatherPackedTiles(tiles,sizes,numTiles,framing,pieces,pieceSizes);
+
+    size_t numBytes = 0;
+    for (auto pieceSize : pieceSizes)
+      numBytes += pieceSize;
+    Mailbox::Message::SP container = std::make_shared<Mailbox::Message>();
+    container->resize(numBytes);
+    size_t offset = 0;
+    for (size_t i=0;i<pieces.size();i++) {
+      memcpy(container->data()+offset,pieces[i],pieceSizes[i]);
+      offset += pieceSizes[i];
+    }
+    return container;
+  }
+
+  /*! the pieces the given tile messages packed into one container
+    consist of */
+  void TilePacker::pack(const std::vector<Mailbox::Message::SP> &messages,
+                        std::vector<uint8_t>      &framing,
+                        std::vector<const void *> &pieces,
+                        std::vector<size_t>       &pieceSizes)
+  {
+    std::vector<const uint8_t *> tiles(messages.size());
+    std::vector<size_t>          sizes(messages.size());
+    for (size_t i=0;i<messages.size();i++) {
+      tiles[i] = messages[i]->data();
+      sizes[i] = messages[i]->size();
+    }
+    gatherPackedTiles(tiles.data(),sizes.data(),tiles.size(),framing,pieces,pieceSizes);
+  }
+
+  /*! (offset,size) of every tile message in given container */
+  std::vector<std::pair<size_t,size_t>> packedTiles(const Mailbox::Message &container)
+  {
+    const TileMessageDataHeader *header = (const TileMessageDataHeader *)container.data();
+    assert(header->flags & TileMessageDataHeader::CONTAINER);
+    const size_t numTiles = *(const uint32_t *)(header+1);
+
+    std::vector<std::pair<size_t,size_t>> tiles(numTiles);
+    size_t offset = firstPackedTileOffset();
+    for (size_t i=0;i<numTiles;i++) {
+      const size_t size = *(const uint64_t *)(container.data()+offset);
+      offset += packedTileAlignment;
+      if (offset+size > container.size())
+        throw std::runtime_error("corrupt tile container");
+      tiles[i] = { offset, size };
+      offset = alignedOffset(offset + size);
+    }
+    return tiles;
+  }
+  
   struct PlainTileEncoder : public TileEncoder {
-    virtual Mailbox::Message::SP encode(const PlainTile &tile) override
+    virtual Mailbox::Message::SP encode(const PlainTile &tile,
+                                        const EncodeParams &/*params*/) override
     {
-      Mailbox::Message::SP message = std::make_shared<Mailbox::Message>();
-      message->resize(sizeof(TileMessageDataHeader)
-                      +
-                      sizeof(uint32_t)*tile.region.size().product());
-      TileMessageDataHeader *header = (TileMessageDataHeader*)message->data();
-      header->frameID = tile.frameID;
-      header->region  = tile.region;
-      header->eye     = tile.eye;
-      uint32_t *out = (uint32_t*)&header[+1];
+      const vec2i size = tile.size();
+      Mailbox::Message::SP message;
+      if (tile.storage && tile.pitch == size.x
+          && (uint8_t*)tile.pixels == tile.storage->data()+sizeof(TileMessageDataHeader)
+          && tile.storage->size() == PlainTile::storageSize(tile.region)) {
+        // the tile's pixels already are in the right place in a
+        // message - ship that one as is
+        message = tile.storage;
+      } else {
+        message = std::make_shared<Mailbox::Message>();
+        message->resize(sizeof(TileMessageDataHeader)
+                        +
+                        sizeof(uint32_t)*size.product());
+        uint32_t *out = (uint32_t*)(message->data()+sizeof(TileMessageDataHeader));
+        for (int iy=0;iy<size.y;iy++)
+          memcpy(out+iy*size.x,tile.pixels+iy*tile.pitch,size.x*sizeof(uint32_t));
+      }
+      writeHeader((TileMessageDataHeader*)message->data(),tile,CODEC_PLAIN);
       
-      assert(message->size() == sizeof(TileMessageDataHeader)+tile.pixels.size()*sizeof(uint32_t));
-      memcpy(out,tile.pixels.data(),tile.pixels.size()*sizeof(uint32_t));
+      assert(message->size() == sizeof(TileMessageDataHeader)+size.product()*sizeof(uint32_t));
       return message;
     }
   };
@@ -48,21 +477,858 @@ namespace dw2 {
   struct PlainTileDecoder : public TileDecoder {
     
     virtual void decode(PlainTile &tile,
-                        Mailbox::Message::SP message) override
+                        Mailbox::Message::SP message,
+                        size_t offset, size_t size) override
     {
-      TileMessageDataHeader *header = (TileMessageDataHeader*)message->data();
-      tile.alloc(header->region,header->eye);
-      tile.frameID = header->frameID;
-      const vec2i size  = tile.region.size();
-      size_t numBytes = size.x*size.y*sizeof(uint32_t);
-      assert(message->size() == (sizeof(TileMessageDataHeader)+numBytes));
-      uint32_t *out = tile.pixels.data();
-      const uint32_t *in = (const uint32_t *)&header[+1];
-      memcpy(out,in,numBytes);
+      TileMessageDataHeader *header = (TileMessageDataHeader*)(message->data()+offset);
+      if (size < sizeof(TileMessageDataHeader) ||
+          size != (sizeof(TileMessageDataHeader)
+                   +header->region.size().product()*sizeof(uint32_t)))
+        throw std::runtime_error("corrupt plain tile");
+      const uint32_t *pixels = (const uint32_t *)&header[+1];
+      if (hasTarget(tile,header)) {
+        readHeader(tile,header);
+        blit(tile.pixels,tile.region,tile.pitch,pixels,tile.region,tile.size().x);
+        return;
+      }
+      // the message already has the pixels in exactly the layout we
+      // need - just refer to them
+      readHeader(tile,header);
+      tile.pitch   = tile.region.size().x;
+      tile.storage = message;
+      tile.pixels  = (uint32_t *)pixels;
+    }
+  };
+
+  // ==================================================================
+  // lossless codec: every pixel gets predicted from the one above it
+  // (or, in the first row, the one left of it), and the per-byte
+  // residuals get split into one plane per channel, so the LZ stage
+  // sees long runs of (mostly) zeroes rather than interleaved
+  // channels. Both steps are SIMD on both ends.
+  //
+  // temporal codec: same, but predicts every pixel from the same
+  // pixel in the region's reference tile (see ReferenceTiles),
+  // xor-ing rather than subtracting; falls back to the lossless
+  // codec's prediction if there is no reference, or if too much has
+  // changed since.
+  // ==================================================================
+
+  /*! per-byte (ie, per-channel, modulo 256) difference and sum of
+      two pixels */
+  static inline uint32_t subBytes(uint32_t a, uint32_t b)
+  { return ((a | 0x80808080u) - (b & 0x7f7f7f7fu)) ^ ((a ^ ~b) & 0x80808080u); }
+  static inline uint32_t addBytes(uint32_t a, uint32_t b)
+  { return ((a & 0x7f7f7f7fu) + (b & 0x7f7f7f7fu)) ^ ((a ^ b) & 0x80808080u); }
+
+  /*! a pixel's residual, given the pixel it gets predicted from */
+  template<bool temporal>
+  static inline uint32_t residual(uint32_t pixel, uint32_t predicted)
+  { return temporal ? pixel ^ predicted : subBytes(pixel,predicted); }
+
+  /*! the reverse of residual() */
+  template<bool temporal>
+  static inline uint32_t reconstruct(uint32_t residual, uint32_t predicted)
+  { return temporal ? residual ^ predicted : addBytes(residual,predicted); }
+  
+  static inline void storePlanes(uint8_t *const planes[4], int x, uint32_t r)
+  {
+    planes[0][x] = uint8_t(r);
+    planes[1][x] = uint8_t(r>>8);
+    planes[2][x] = uint8_t(r>>16);
+    planes[3][x] = uint8_t(r>>24);
+  }
+
+  static inline uint32_t loadPlanes(const uint8_t *const planes[4], int x)
+  {
+    return
+      planes[0][x]
+      | (planes[1][x] << 8)
+      | (planes[2][x] << 16)
+      | (uint32_t(planes[3][x]) << 24);
+  }
+  
+  /*! compute the residuals of one row of 'width' pixels, and store
+      them into the four planes (each of which already points to this
+      row); 'predicted' is the row to predict from - the row above
+      (or, if temporal, the reference tile's same row) - or null to
+      predict every pixel from its left neighbor */
+  template<bool temporal>
+  static void splitResidualRow(uint8_t *const planes[4],
+                               const uint32_t *row,
+                               const uint32_t *predicted,
+                               int width)
+  {
+    int x = 0;
+    if (!predicted) {
+      for (;x<width;x++)
+        storePlanes(planes,x,subBytes(row[x],x ? row[x-1] : 0));
+      return;
+    }
+#if DW2_SSE2
+    const __m128i lowByte = _mm_set1_epi32(0xff);
+    for (;x+16<=width;x+=16) {
+      __m128i r[4];
+      for (int i=0;i<4;i++) {
+        const __m128i p = _mm_loadu_si128((const __m128i*)(row+x+4*i));
+        const __m128i q = _mm_loadu_si128((const __m128i*)(predicted+x+4*i));
+        r[i] = temporal ? _mm_xor_si128(p,q) : _mm_sub_epi8(p,q);
+      }
+      for (int c=0;c<4;c++) {
+        // 16 pixels' byte #c each, narrowed 32->16->8 bits
+        __m128i b[4];
+        for (int i=0;i<4;i++)
+          b[i] = _mm_and_si128(_mm_srli_epi32(r[i],8*c),lowByte);
+        _mm_storeu_si128((__m128i*)(planes[c]+x),
+                         _mm_packus_epi16(_mm_packs_epi32(b[0],b[1]),
+                                          _mm_packs_epi32(b[2],b[3])));
+      }
+    }
+#endif
+    for (;x<width;x++)
+      storePlanes(planes,x,residual<temporal>(row[x],predicted[x]));
+  }
+
+  /*! the reverse of splitResidualRow() */
+  template<bool temporal>
+  static void mergeResidualRow(uint32_t *row,
+                               const uint32_t *predicted,
+                               const uint8_t *const planes[4],
+                               int width)
+  {
+    int x = 0;
+    if (!predicted) {
+      uint32_t left = 0;
+      for (;x<width;x++)
+        row[x] = left = addBytes(left,loadPlanes(planes,x));
+      return;
+    }
+#if DW2_SSE2
+    for (;x+16<=width;x+=16) {
+      const __m128i c0 = _mm_loadu_si128((const __m128i*)(planes[0]+x));
+      const __m128i c1 = _mm_loadu_si128((const __m128i*)(planes[1]+x));
+      const __m128i c2 = _mm_loadu_si128((const __m128i*)(planes[2]+x));
+      const __m128i c3 = _mm_loadu_si128((const __m128i*)(planes[3]+x));
+      const __m128i c01lo = _mm_unpacklo_epi8(c0,c1), c01hi = _mm_unpackhi_epi8(c0,c1);
+      const __m128i c23lo = _mm_unpacklo_epi8(c2,c3), c23hi = _mm_unpackhi_epi8(c2,c3);
+      const __m128i r[4] = {
+        _mm_unpacklo_epi16(c01lo,c23lo), _mm_unpackhi_epi16(c01lo,c23lo),
+        _mm_unpacklo_epi16(c01hi,c23hi), _mm_unpackhi_epi16(c01hi,c23hi)
+      };
+      for (int i=0;i<4;i++) {
+        const __m128i q = _mm_loadu_si128((const __m128i*)(predicted+x+4*i));
+        _mm_storeu_si128((__m128i*)(row+x+4*i),
+                         temporal ? _mm_xor_si128(r[i],q) : _mm_add_epi8(r[i],q));
+      }
+    }
+#endif
+    for (;x<width;x++)
+      row[x] = reconstruct<temporal>(loadPlanes(planes,x),predicted[x]);
+  }
+
+  /*! split a tile's pixels into byte planes of residuals; against
+      the given reference tile if that is non-null, else against the
+      pixels above/left */
+  static void splitResiduals(std::vector<uint8_t> &residuals,
+                             const PlainTile &tile,
+                             const PlainTile *reference)
+  {
+    const vec2i  size      = tile.size();
+    const size_t numPixels = size.product();
+    residuals.resize(4*numPixels);
+    for (int iy=0;iy<size.y;iy++) {
+      uint8_t *const planes[4] = {
+        residuals.data()+0*numPixels+iy*size.x,
+        residuals.data()+1*numPixels+iy*size.x,
+        residuals.data()+2*numPixels+iy*size.x,
+        residuals.data()+3*numPixels+iy*size.x
+      };
+      const uint32_t *row = tile.pixels+iy*tile.pitch;
+      if (reference)
+        splitResidualRow<true>(planes,row,reference->pixels+iy*reference->pitch,size.x);
+      else
+        splitResidualRow<false>(planes,row,iy ? row-tile.pitch : nullptr,size.x);
+    }
+  }
+  
+  /*! the reverse of splitResiduals(); 'tile' already has its region
+      and pixel storage */
+  static void mergeResiduals(PlainTile &tile,
+                             const std::vector<uint8_t> &residuals,
+                             const PlainTile *reference)
+  {
+    const vec2i  size      = tile.size();
+    const size_t numPixels = size.product();
+    for (int iy=0;iy<size.y;iy++) {
+      const uint8_t *const planes[4] = {
+        residuals.data()+0*numPixels+iy*size.x,
+        residuals.data()+1*numPixels+iy*size.x,
+        residuals.data()+2*numPixels+iy*size.x,
+        residuals.data()+3*numPixels+iy*size.x
+      };
+      uint32_t *row = tile.pixels+iy*tile.pitch;
+      if (reference)
+        mergeResidualRow<true>(row,reference->pixels+iy*reference->pitch,planes,size.x);
+      else
+        mergeResidualRow<false>(row,iy ? row-tile.pitch : nullptr,planes,size.x);
+    }
+  }
+
+  /*! LZ-compress the given residuals into a new message, behind
+      the header and 'extraBytes' bytes of codec-specific data;
+      returns the message */
+  static Mailbox::Message::SP compressResiduals(LZCompressor &compressor,
+                                                const std::vector<uint8_t> &residuals,
+                                                size_t extraBytes)
+  {
+    const size_t ofs = sizeof(TileMessageDataHeader)+extraBytes;
+    Mailbox::Message::SP message = std::make_shared<Mailbox::Message>();
+    message->resize(ofs+LZCompressor::bound(residuals.size()));
+    const size_t compressedSize
+      = compressor.compress(message->data()+ofs,residuals.data(),residuals.size());
+    message->resize(ofs+compressedSize);
+    return message;
+  }
+
+  /*! the reverse of compressResiduals() */
+  static void decompressResiduals(std::vector<uint8_t> &residuals,
+                                  size_t numPixels,
+                                  const uint8_t *in, size_t size)
+  {
+    residuals.resize(4*numPixels);
+    if (!lzDecompress(residuals.data(),residuals.size(),in,size))
+      throw std::runtime_error("corrupt lossless tile");
+  }
+  
+  struct LosslessTileEncoder : public TileEncoder {
+    virtual Mailbox::Message::SP encode(const PlainTile &tile,
+                                        const EncodeParams &/*params*/) override
+    {
+      splitResiduals(residuals,tile,nullptr);
+      Mailbox::Message::SP message = compressResiduals(compressor,residuals,0);
+      writeHeader((TileMessageDataHeader *)message->data(),tile,CODEC_LOSSLESS);
+      return message;
+    }
+
+    LZCompressor         compressor;
+    std::vector<uint8_t> residuals;
+  };
+  
+  struct LosslessTileDecoder : public TileDecoder {
+    virtual void decode(PlainTile &tile,
+                        Mailbox::Message::SP message,
+                        size_t offset, size_t size) override
+    {
+      const TileMessageDataHeader *header
+        = (const TileMessageDataHeader *)(message->data()+offset);
+      prepareToDecode(tile,header);
+      decompressResiduals(residuals,tile.size().product(),
+                          (const uint8_t*)(header+1),size-sizeof(*header));
+      mergeResiduals(tile,residuals,nullptr);
+    }
+
+    std::vector<uint8_t> residuals;
+  };
+
+  /*! what the temporal codec puts between the header and the
+      compressed residuals */
+  struct TemporalTileInfo {
+    /*! frame of the reference tile the residuals are relative to;
+        -1 if they are not relative to any */
+    int32_t referenceFrameID;
+  };
+
+  /*! whether decoding the given tile message needs what the display
+    got for the frame before */
+  bool needsFrameBefore(const TileMessageDataHeader *header)
+  {
+    if (header->flags & TileMessageDataHeader::UNCHANGED)
+      return true;
+    return header->codec == CODEC_TEMPORAL
+      && ((const TemporalTileInfo *)(header+1))->referenceFrameID >= 0;
+  }
+
+  /*! if more than 1/that of a tile's pixels changed since the
+      reference, we rather encode it on its own */
+  static const int maxChangedFraction = 2;
+  
+  /*! if a tile's residuals relative to its reference compress to
+      more than 1/that of its size, it is worth trying whether it
+      compresses better on its own */
+  static const int maxTemporalRatio = 16;
+  
+  /*! whether so much changed between tile and reference that
+      there's no point in encoding the one against the other */
+  static bool changedTooMuch(const PlainTile &tile, const PlainTile &reference)
+  {
+    const vec2i  size       = tile.size();
+    const size_t maxChanged = size.product() / maxChangedFraction;
+    size_t numChanged = 0;
+    for (int iy=0;iy<size.y;iy++) {
+      const uint32_t *a = tile.pixels+iy*tile.pitch;
+      const uint32_t *b = reference.pixels+iy*reference.pitch;
+      for (int ix=0;ix<size.x;ix++)
+        numChanged += (a[ix] != b[ix]);
+      if (numChanged > maxChanged)
+        return true;
+    }
+    return false;
+  }
+  
+  /*! a copy of given tile that owns its pixels */
+  static PlainTile copyOf(const PlainTile &tile)
+  {
+    PlainTile copy;
+    copy.alloc(tile.region,tile.eye);
+    copy.frameID = tile.frameID;
+    copy.scale   = tile.scale;
+    blit(copy.pixels,copy.region,copy.pitch,tile.pixels,tile.region,tile.pitch);
+    return copy;
+  }
+  
+  struct TemporalTileEncoder : public TileEncoder {
+    TemporalTileEncoder(ReferenceTiles::SP references)
+      : references(references)
+    {}
+    
+    virtual Mailbox::Message::SP encode(const PlainTile &tile,
+                                        const EncodeParams &/*params*/) override
+    {
+      PlainTile reference;
+      bool haveReference
+        = references
+        && references->get(tile,tile.frameID-1,reference)
+        && !changedTooMuch(tile,reference);
+      Mailbox::Message::SP message;
+      if (haveReference) {
+        splitResiduals(residuals,tile,&reference);
+        message = compressResiduals(compressor,residuals,sizeof(TemporalTileInfo));
+      }
+      if (!haveReference
+          || message->size() > residuals.size()/maxTemporalRatio) {
+        // the changes are not all that small after all; see if
+        // encoding this tile on its own does any better
+        splitResiduals(residuals,tile,nullptr);
+        Mailbox::Message::SP intra
+          = compressResiduals(compressor,residuals,sizeof(TemporalTileInfo));
+        if (!message || intra->size() < message->size()) {
+          message       = intra;
+          haveReference = false;
+        }
+      }
+      TileMessageDataHeader *header = (TileMessageDataHeader *)message->data();
+      writeHeader(header,tile,CODEC_TEMPORAL);
+      ((TemporalTileInfo *)(header+1))->referenceFrameID
+        = haveReference ? reference.frameID : -1;
+
+      if (references)
+        // the tile's pixels belong to the app (or the tile pool), so
+        // the reference needs a copy of its own
+        references->set(copyOf(tile));
+      return message;
+    }
+
+    ReferenceTiles::SP   references;
+    LZCompressor         compressor;
+    std::vector<uint8_t> residuals;
+  };
+  
+  struct TemporalTileDecoder : public TileDecoder {
+    TemporalTileDecoder(ReferenceTiles::SP references)
+      : references(references)
+    {}
+    
+    virtual void decode(PlainTile &tile,
+                        Mailbox::Message::SP message,
+                        size_t offset, size_t size) override
+    {
+      const TileMessageDataHeader *header
+        = (const TileMessageDataHeader *)(message->data()+offset);
+      const TemporalTileInfo *info = (const TemporalTileInfo *)(header+1);
+      prepareToDecode(tile,header);
+
+      PlainTile reference;
+      if (info->referenceFrameID >= 0
+          && !references->get(tile,info->referenceFrameID,reference))
+        throw MissingReferenceTile();
+      decompressResiduals(residuals,tile.size().product(),(const uint8_t*)(info+1),
+                          size-sizeof(*header)-sizeof(*info));
+      mergeResiduals(tile,residuals,info->referenceFrameID >= 0 ? &reference : nullptr);
+      if (tile.storage)
+        // the decoded tile owns its pixels, and nobody is going to
+        // change them any more
+        references->set(tile);
+      else
+        // we decoded into somebody else's pixels
+        references->set(copyOf(tile));
+    }
+
+    ReferenceTiles::SP   references;
+    std::vector<uint8_t> residuals;
+  };
+
+  // ==================================================================
+  // block codec: fixed-rate, in the style of BC1/DXT1 textures. Every
+  // 4x4 block of pixels becomes two RGB565 end-point colors, plus a
+  // 2-bit index per pixel that picks one of four colors on the line
+  // between the two. Alpha does not get encoded (tiles decode as
+  // opaque), same as with jpeg.
+  // ==================================================================
+
+  /*! width and height of a block, in pixels */
+  static const int blockSize = 4;
+
+  /*! one encoded 4x4 block; the index of pixel (ix,iy) is in bits
+      2*(4*iy+ix) and up */
+  struct EncodedBlock {
+    uint16_t color0, color1;
+    uint32_t indices;
+  };
+  
+  /*! size of the message that a tile of given size encodes to with
+    CODEC_BLOCK, header included */
+  size_t blockCodecMessageSize(const vec2i &tileSize)
+  {
+    const vec2i numBlocks = divRoundUp(tileSize,vec2i(blockSize));
+    return sizeof(TileMessageDataHeader) + sizeof(EncodedBlock)*numBlocks.product();
+  }
+
+  static inline uint16_t toRGB565(const int rgb[3])
+  { return uint16_t(((rgb[0] >> 3) << 11) | ((rgb[1] >> 2) << 5) | (rgb[2] >> 3)); }
+
+  /*! the reverse of toRGB565(), with the low bits filled in such
+      that 0 and 255 map to themselves */
+  static inline uint32_t fromRGB565(uint16_t c)
+  {
+    const uint32_t r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    return
+      ((r << 3) | (r >> 2))
+      | (((g << 2) | (g >> 4)) << 8)
+      | (((b << 3) | (b >> 2)) << 16)
+      | 0xff000000u;
+  }
+
+  static inline int channel(uint32_t pixel, int c) { return (pixel >> (8*c)) & 0xff; }
+
+  /*! the color 'wa' parts 'a' and 'wb' parts 'b' */
+  static inline uint32_t mixColors(uint32_t a, int wa, uint32_t b, int wb)
+  {
+    uint32_t mixed = 0xff000000u;
+    for (int c=0;c<3;c++)
+      mixed |= uint32_t((wa*channel(a,c)+wb*channel(b,c))/(wa+wb)) << (8*c);
+    return mixed;
+  }
+  
+  /*! encode the given block of 16 pixels (row by row) */
+  static EncodedBlock encodeBlock(const uint32_t pixels[16])
+  {
+    // end points: the bounding box of the block's colors ...
+    int lo[3] = { 255,255,255 }, hi[3] = { 0,0,0 }, sum[3] = { 0,0,0 };
+    for (int i=0;i<16;i++)
+      for (int c=0;c<3;c++) {
+        const int v = channel(pixels[i],c);
+        lo[c] = std::min(lo[c],v);
+        hi[c] = std::max(hi[c],v);
+        sum[c] += v;
+      }
+    // ... along whichever of its diagonals the colors follow: flip
+    // every channel that goes down while the one that varies the
+    // most goes up
+    int major = 0;
+    for (int c=1;c<3;c++)
+      if (hi[c]-lo[c] > hi[major]-lo[major]) major = c;
+    int covariance[3] = { 0,0,0 };
+    for (int i=0;i<16;i++) {
+      const int dMajor = 16*channel(pixels[i],major)-sum[major];
+      for (int c=0;c<3;c++)
+        covariance[c] += dMajor * (16*channel(pixels[i],c)-sum[c]);
+    }
+    for (int c=0;c<3;c++) {
+      if (covariance[c] < 0) std::swap(lo[c],hi[c]);
+      // move the end points inwards a little; with only four colors
+      // between them, that costs less at the ends than it gains in
+      // between
+      const int inset = (hi[c]-lo[c])/16;
+      lo[c] += inset;
+      hi[c] -= inset;
+    }
+
+    EncodedBlock block;
+    block.color0  = toRGB565(hi);
+    block.color1  = toRGB565(lo);
+    block.indices = 0;
+    if (block.color0 == block.color1)
+      // all pixels get color0
+      return block;
+    // color0 > color1 is what tells a decoder to use four colors
+    // (rather than three, and black)
+    if (block.color0 < block.color1)
+      std::swap(block.color0,block.color1);
+
+    // every pixel gets the color closest to its projection onto the
+    // line between the end points; steps 0..3 along that line are
+    // indices 0,2,3,1
+    static const uint32_t indexOfStep[4] = { 0,2,3,1 };
+    const uint32_t end0 = fromRGB565(block.color0);
+    const uint32_t end1 = fromRGB565(block.color1);
+    int axis[3], lengthSquared = 0;
+    for (int c=0;c<3;c++) {
+      axis[c] = channel(end1,c)-channel(end0,c);
+      lengthSquared += axis[c]*axis[c];
+    }
+    for (int i=0;i<16;i++) {
+      int t = 0;
+      for (int c=0;c<3;c++)
+        t += (channel(pixels[i],c)-channel(end0,c))*axis[c];
+      const int step
+        = t <= 0
+        ? 0
+        : std::min(3,(6*t+lengthSquared)/(2*lengthSquared));
+      block.indices |= indexOfStep[step] << (2*i);
+    }
+    return block;
+  }
+
+  /*! decode given block into 4x4 pixels at 'out', which is 'pitch'
+      pixels wide */
+  static inline void decodeBlock(uint32_t *out, int pitch, const EncodedBlock &block)
+  {
+    const uint32_t color0 = fromRGB565(block.color0);
+    const uint32_t color1 = fromRGB565(block.color1);
+    uint32_t palette[4] = { color0, color1 };
+    if (block.color0 > block.color1) {
+      palette[2] = mixColors(color0,2,color1,1);
+      palette[3] = mixColors(color0,1,color1,2);
+    } else {
+      palette[2] = mixColors(color0,1,color1,1);
+      palette[3] = 0xff000000u;
+    }
+#if DW2_SSE2
+    // every lane looks at its own two bits of the row's byte of
+    // indices, and picks the palette entry whose index matches
+    const __m128i laneBits = _mm_setr_epi32(3,3<<2,3<<4,3<<6);
+    const __m128i index1   = _mm_setr_epi32(1,1<<2,1<<4,1<<6);
+    const __m128i index2   = _mm_setr_epi32(2,2<<2,2<<4,2<<6);
+    const __m128i p0 = _mm_set1_epi32(palette[0]);
+    const __m128i p1 = _mm_set1_epi32(palette[1]);
+    const __m128i p2 = _mm_set1_epi32(palette[2]);
+    const __m128i p3 = _mm_set1_epi32(palette[3]);
+    for (int iy=0;iy<blockSize;iy++) {
+      const __m128i bits
+        = _mm_and_si128(_mm_set1_epi32(block.indices >> (8*iy)),laneBits);
+      const __m128i row
+        = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_cmpeq_epi32(bits,_mm_setzero_si128()),p0),
+                                    _mm_and_si128(_mm_cmpeq_epi32(bits,index1),p1)),
+                       _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi32(bits,index2),p2),
+                                    _mm_and_si128(_mm_cmpeq_epi32(bits,laneBits),p3)));
+      _mm_storeu_si128((__m128i*)(out+iy*pitch),row);
+    }
+#else
+    for (int iy=0;iy<blockSize;iy++)
+      for (int ix=0;ix<blockSize;ix++)
+        out[iy*pitch+ix] = palette[(block.indices >> (2*(iy*blockSize+ix))) & 3];
+#endif
+  }
+  
+  struct BlockTileEncoder : public TileEncoder {
+    virtual Mailbox::Message::SP encode(const PlainTile &tile,
+                                        const EncodeParams &/*params*/) override
+    {
+      const vec2i size = tile.size();
+      // we know exactly how big the message is going to be, so we
+      // can get one from the pool up front
+      Mailbox::Message::SP message = messages.get(blockCodecMessageSize(size));
+      TileMessageDataHeader *header = (TileMessageDataHeader *)message->data();
+      writeHeader(header,tile,CODEC_BLOCK);
+
+      EncodedBlock *out = (EncodedBlock *)(header+1);
+      uint32_t pixels[blockSize*blockSize];
+      for (int by=0;by<size.y;by+=blockSize)
+        for (int bx=0;bx<size.x;bx+=blockSize) {
+          // blocks that stick out of the tile repeat its last
+          // row/column
+          for (int iy=0;iy<blockSize;iy++) {
+            const uint32_t *row = tile.pixels+std::min(by+iy,size.y-1)*tile.pitch;
+            for (int ix=0;ix<blockSize;ix++)
+              pixels[iy*blockSize+ix] = row[std::min(bx+ix,size.x-1)];
+          }
+          *out++ = encodeBlock(pixels);
+        }
+      assert((uint8_t*)out == message->data()+message->size());
+      return message;
+    }
+
+    MessagePool messages;
+  };
+  
+  struct BlockTileDecoder : public TileDecoder {
+    virtual void decode(PlainTile &tile,
+                        Mailbox::Message::SP message,
+                        size_t offset, size_t size) override
+    {
+      const TileMessageDataHeader *header
+        = (const TileMessageDataHeader *)(message->data()+offset);
+      if (size != blockCodecMessageSize(header->region.size()))
+        throw std::runtime_error("corrupt block-coded tile");
+      prepareToDecode(tile,header);
+
+      const vec2i tileSize = tile.size();
+      const EncodedBlock *in = (const EncodedBlock *)(header+1);
+      for (int by=0;by<tileSize.y;by+=blockSize)
+        for (int bx=0;bx<tileSize.x;bx+=blockSize) {
+          uint32_t *out = tile.pixels+by*tile.pitch+bx;
+          if (bx+blockSize <= tileSize.x && by+blockSize <= tileSize.y) {
+            decodeBlock(out,tile.pitch,*in++);
+            continue;
+          }
+          // block sticks out of the tile: decode into a temporary,
+          // and copy the part that is inside
+          uint32_t pixels[blockSize*blockSize];
+          decodeBlock(pixels,blockSize,*in++);
+          const int w = std::min(blockSize,tileSize.x-bx);
+          const int h = std::min(blockSize,tileSize.y-by);
+          for (int iy=0;iy<h;iy++)
+            memcpy(out+iy*tile.pitch,pixels+iy*blockSize,w*sizeof(uint32_t));
+        }
+    }
+  };
+
+  // ==================================================================
+  // solid and palette codecs, for tiles that classifyTile() found to
+  // be all one color, respectively to have only a few colors: a solid
+  // tile is just its color; a palette tile is its colors, plus one
+  // index per pixel, packed into as few bits as the number of colors
+  // allows, and LZ-compressed. Both are lossless.
+  // ==================================================================
+
+  /*! a palette has to be small compared to the tile for it to pay
+      off: at most 1/that as many colors as the tile has pixels (and
+      never more than maxPaletteColors) */
+  static const int minPixelsPerColor = 16;
+  static const int maxPaletteColors  = 256;
+
+  /*! the distinct colors of a tile, as long as there are not too
+      many of them */
+  struct Palette {
+    /*! collect the colors of given tile; returns false (and stops
+        looking) as soon as there are more than 'maxColors' */
+    bool build(const PlainTile &tile, int maxColors)
+    {
+      colors.clear();
+      std::fill(slots,slots+numSlots,0);
+      const vec2i size = tile.size();
+      for (int iy=0;iy<size.y;iy++) {
+        const uint32_t *row = tile.pixels+iy*tile.pitch;
+        for (int ix=0;ix<size.x;ix++) {
+          // runs of the same color are what few-color content
+          // mostly consists of
+          if (ix && row[ix] == row[ix-1]) continue;
+          int &slot = slotOf(row[ix]);
+          if (slot) continue;
+          if ((int)colors.size() == maxColors) return false;
+          colors.push_back(row[ix]);
+          slot = (int)colors.size();
+        }
+      }
+      return true;
+    }
+
+    /*! index of given color, which has to be in the palette */
+    inline int indexOf(uint32_t color) { return slotOf(color)-1; }
+
+    std::vector<uint32_t> colors;
+    
+  private:
+    /*! open-addressed hash table: 'slots' holds index+1 of the
+        colors hashed there, 0 if none */
+    static const int numSlots = 2*maxPaletteColors;
+    inline int &slotOf(uint32_t color)
+    {
+      int i = (color * 0x9E3779B1u) >> 23;
+      while (slots[i] && colors[slots[i]-1] != color)
+        i = (i+1) & (numSlots-1);
+      return slots[i];
+    }
+    int slots[numSlots];
+  };
+
+  /*! bits per index for a palette of given size: 1, 2, 4, or 8 */
+  static inline int bitsPerIndex(int numColors)
+  {
+    int bits = 1;
+    while ((1 << bits) < numColors) bits *= 2;
+    return bits;
+  }
+
+  /*! bytes of one row of 'width' packed indices */
+  static inline size_t packedRowSize(int width, int bits)
+  { return divRoundUp(size_t(width)*bits,size_t(8)); }
+
+  /*! look at the tile's content, and pick the codec that suits it
+    best: CODEC_SOLID, CODEC_PALETTE, or (for everything else) the
+    given one */
+  int classifyTile(const PlainTile &tile, int photographicCodec)
+  {
+    const int maxColors
+      = std::min(maxPaletteColors,tile.size().product()/minPixelsPerColor);
+    // the palette encoder will build its own; this is only to count
+    thread_local Palette palette;
+    if (!palette.build(tile,std::max(maxColors,1)))
+      return photographicCodec;
+    return palette.colors.size() == 1 ? CODEC_SOLID : CODEC_PALETTE;
+  }
+  
+  struct SolidTileEncoder : public TileEncoder {
+    virtual Mailbox::Message::SP encode(const PlainTile &tile,
+                                        const EncodeParams &/*params*/) override
+    {
+      Mailbox::Message::SP message = std::make_shared<Mailbox::Message>();
+      message->resize(sizeof(TileMessageDataHeader)+sizeof(uint32_t));
+      TileMessageDataHeader *header = (TileMessageDataHeader *)message->data();
+      writeHeader(header,tile,CODEC_SOLID);
+      *(uint32_t *)(header+1) = tile.pixels[0];
+      return message;
     }
   };
 
+  struct SolidTileDecoder : public TileDecoder {
+    virtual void decode(PlainTile &tile,
+                        Mailbox::Message::SP message,
+                        size_t offset, size_t size) override
+    {
+      const TileMessageDataHeader *header
+        = (const TileMessageDataHeader *)(message->data()+offset);
+      if (size != sizeof(*header)+sizeof(uint32_t))
+        throw std::runtime_error("corrupt solid tile");
+      prepareToDecode(tile,header);
+      const uint32_t color = *(const uint32_t *)(header+1);
+      for (int iy=0;iy<tile.size().y;iy++)
+        std::fill_n(tile.pixels+iy*tile.pitch,tile.size().x,color);
+    }
+  };
+
+  /*! what the palette codec puts between the header and the
+      palette's colors, which the compressed indices follow */
+  struct PaletteTileInfo {
+    int32_t numColors;
+  };
+
+  struct PaletteTileEncoder : public TileEncoder {
+    virtual Mailbox::Message::SP encode(const PlainTile &tile,
+                                        const EncodeParams &/*params*/) override
+    {
+      if (!palette.build(tile,maxPaletteColors))
+        throw std::runtime_error("PaletteTileEncoder: tile has too many colors");
+      const vec2i  size     = tile.size();
+      const int    bits     = bitsPerIndex((int)palette.colors.size());
+      const size_t rowBytes = packedRowSize(size.x,bits);
+      indices.resize(rowBytes*size.y);
+      std::fill(indices.begin(),indices.end(),0);
+      for (int iy=0;iy<size.y;iy++) {
+        const uint32_t *row = tile.pixels+iy*tile.pitch;
+        uint8_t *out = indices.data()+iy*rowBytes;
+        int index = 0;
+        for (int ix=0;ix<size.x;ix++) {
+          if (!ix || row[ix] != row[ix-1])
+            index = palette.indexOf(row[ix]);
+          const int bit = ix*bits;
+          out[bit/8] |= index << (bit%8);
+        }
+      }
+
+      const size_t paletteBytes
+        = sizeof(PaletteTileInfo)+palette.colors.size()*sizeof(uint32_t);
+      Mailbox::Message::SP message = std::make_shared<Mailbox::Message>();
+      message->resize(sizeof(TileMessageDataHeader)+paletteBytes
+                      +LZCompressor::bound(indices.size()));
+      TileMessageDataHeader *header = (TileMessageDataHeader *)message->data();
+      writeHeader(header,tile,CODEC_PALETTE);
+      PaletteTileInfo *info = (PaletteTileInfo *)(header+1);
+      info->numColors = (int32_t)palette.colors.size();
+      memcpy(info+1,palette.colors.data(),palette.colors.size()*sizeof(uint32_t));
+      const size_t compressedSize
+        = compressor.compress((uint8_t *)(info+1)+palette.colors.size()*sizeof(uint32_t),
+                              indices.data(),indices.size());
+      message->resize(sizeof(TileMessageDataHeader)+paletteBytes+compressedSize);
+      return message;
+    }
+
+    Palette              palette;
+    LZCompressor         compressor;
+    std::vector<uint8_t> indices;
+  };
+
+  /*! look up one row of 'width' indices of 'bits' bits each */
+  template<int bits>
+  static inline void unpackRow(uint32_t *out, const uint8_t *in,
+                               const uint32_t *palette, int width)
+  {
+    const int perByte = 8/bits;
+    const int mask    = (1 << bits)-1;
+    int x = 0;
+    for (;x+perByte<=width;x+=perByte) {
+      const int byte = in[x/perByte];
+      for (int i=0;i<perByte;i++)
+        out[x+i] = palette[(byte >> (i*bits)) & mask];
+    }
+    for (;x<width;x++)
+      out[x] = palette[(in[x/perByte] >> ((x%perByte)*bits)) & mask];
+  }
+
+  struct PaletteTileDecoder : public TileDecoder {
+    virtual void decode(PlainTile &tile,
+                        Mailbox::Message::SP message,
+                        size_t offset, size_t size) override
+    {
+      const TileMessageDataHeader *header
+        = (const TileMessageDataHeader *)(message->data()+offset);
+      const PaletteTileInfo *info = (const PaletteTileInfo *)(header+1);
+      if (size < sizeof(*header)+sizeof(*info)
+          || info->numColors < 1 || info->numColors > maxPaletteColors)
+        throw std::runtime_error("corrupt palette tile");
+      const size_t paletteBytes = sizeof(*info)+info->numColors*sizeof(uint32_t);
+      if (size < sizeof(*header)+paletteBytes)
+        throw std::runtime_error("corrupt palette tile");
+      prepareToDecode(tile,header);
+
+      // unused entries stay black, so that whatever index a corrupt
+      // tile has, it cannot read past the palette
+      uint32_t palette[maxPaletteColors] = { 0 };
+      memcpy(palette,info+1,info->numColors*sizeof(uint32_t));
+      
+      const vec2i  tileSize = tile.size();
+      const int    bits     = bitsPerIndex(info->numColors);
+      const size_t rowBytes = packedRowSize(tileSize.x,bits);
+      indices.resize(rowBytes*tileSize.y);
+      if (!lzDecompress(indices.data(),indices.size(),
+                        (const uint8_t *)(info+1)+info->numColors*sizeof(uint32_t),
+                        size-sizeof(*header)-paletteBytes))
+        throw std::runtime_error("corrupt palette tile");
+      for (int iy=0;iy<tileSize.y;iy++) {
+        uint32_t      *out = tile.pixels+iy*tile.pitch;
+        const uint8_t *in  = indices.data()+iy*rowBytes;
+        switch (bits) {
+        case 1:  unpackRow<1>(out,in,palette,tileSize.x); break;
+        case 2:  unpackRow<2>(out,in,palette,tileSize.x); break;
+        case 4:  unpackRow<4>(out,in,palette,tileSize.x); break;
+        default: unpackRow<8>(out,in,palette,tileSize.x); break;
+        }
+      }
+    }
+
+    std::vector<uint8_t> indices;
+  };
+
 #if TURBO_JPEG
+  static inline int jpegSubsampling(EncodeParams::ChromaSubsampling subsampling)
+  {
+    switch (subsampling) {
+    case EncodeParams::CHROMA_444: return TJSAMP_444;
+    case EncodeParams::CHROMA_422: return TJSAMP_422;
+    default:                       return TJSAMP_420;
+    }
+  }
+  
   struct JpegTileEncoder : public TileEncoder {
     JpegTileEncoder()
     {
@@ -73,7 +1339,8 @@ namespace dw2 {
       // jpeg_create_compress(&cinfo);
     }
     
-    virtual Mailbox::Message::SP encode(const PlainTile &tile) override
+    virtual Mailbox::Message::SP encode(const PlainTile &tile,
+                                        const EncodeParams &params) override
     {
       /* the output that jpeg will create for us */
       // unsigned char *outBuffer = nullptr;
@@ -88,7 +1355,7 @@ namespace dw2 {
       // jpeg_set_defaults(&cinfo);
       // cinfo.in_color_space   = JCS_EXT_RGBX;
 
-      // jpeg_set_quality(&cinfo, JPEG_QUALITY, TRUE);
+      // jpeg_set_quality(&cinfo, params.quality, TRUE);
       // jpeg_start_compress(&cinfo, TRUE);
 
       // for (int iy=0;iy<tile.size().y;iy++) {
@@ -99,30 +1366,35 @@ namespace dw2 {
       // jpeg_finish_compress(&cinfo);
 
       //! Change to turbo jpeg
-      unsigned char *outBuffer = nullptr;
-      long unsigned outSize;
+      assert(tile.pixels);
+      const int subsampling = jpegSubsampling(params.subsampling);
 
-      assert(tile.pixels.data());
-      int numPixels = tile.size().x * tile.size().y;
-
-      int rc = tjCompress2((tjhandle)compressor, (unsigned char *)tile.pixels.data(),
+      // compress straight into the message, right behind its
+      // header; tjBufSize() is the most this can ever take, so
+      // turbojpeg never needs to (re-)allocate anything
+      const size_t maxSize = tjBufSize(tile.size().x,tile.size().y,subsampling);
+      Mailbox::Message::SP message
+        = messages.get(sizeof(TileMessageDataHeader)+maxSize);
+      TileMessageDataHeader *header = (TileMessageDataHeader *)message->data();
+      unsigned char *outBuffer = (unsigned char *)(header+1);
+      long unsigned  outSize   = maxSize;
+      
+      int rc = tjCompress2((tjhandle)compressor, (unsigned char *)tile.pixels,
                            tile.size().x,tile.pitch*sizeof(int),tile.size().y,
                            TJPF_RGBX, 
                            &outBuffer, 
-                           &outSize,TJSAMP_420,JPEG_QUALITY,0);
+                           &outSize,subsampling,
+                           params.quality,TJFLAG_NOREALLOC);
+      if (rc != 0)
+        throw std::runtime_error(std::string("JpegTileEncoder: ")+tjGetErrorStr());
+      assert(outBuffer == (unsigned char *)(header+1));
 
       //std::cout << "compression ratio: " << (float)outSize / (tile.size().x * tile.size().y * 4)  << "\n";
 
-      Mailbox::Message::SP message = std::make_shared<Mailbox::Message>();
-      message->resize(outSize+sizeof(TileMessageDataHeader) + sizeof(size_t));
-      message->outSize = outSize;
-      TileMessageDataHeader *header = (TileMessageDataHeader *)message->data();
-      header->frameID = tile.frameID;
-      header->region  = tile.region;
-      header->eye     = tile.eye;
-      memcpy(header+1,outBuffer,outSize);
-
-      free(outBuffer);
+      // shrinking keeps the capacity, so the pool can hand the
+      // same message out again without re-allocating
+      message->resize(sizeof(TileMessageDataHeader)+outSize);
+      writeHeader(header,tile,CODEC_JPEG);
       return message;
     }
     
@@ -131,6 +1403,10 @@ namespace dw2 {
     // static void freeCompressor(void *compressor){tjDestroy((tjhandle)compressor);};
 
     tjhandle compressor;
+    /*! where our output messages come from; every one of them has
+        room for the largest jpeg its tile could possibly compress
+        to, so we keep fewer of them around than the default */
+    MessagePool messages { 64 };
 
     // struct jpeg_compress_struct cinfo;
     // struct jpeg_error_mgr jerr;
@@ -145,19 +1421,24 @@ namespace dw2 {
     }
     
     virtual void decode(PlainTile &tile,
-                        Mailbox::Message::SP message) override
+                        Mailbox::Message::SP message,
+                        size_t offset, size_t size) override
     {
       // static std::mutex sync;
       // std::lock_guard<std::mutex> serial(sync);
       
-      TileMessageDataHeader *header = (TileMessageDataHeader *)message->data();
-      tile.alloc(header->region,0);
-      size_t jpegSize = message ->size()-sizeof(*header);
+      TileMessageDataHeader *header = (TileMessageDataHeader *)(message->data()+offset);
+      if (size < sizeof(*header))
+        throw std::runtime_error("corrupt jpeg tile");
+      prepareToDecode(tile,header);
+      size_t jpegSize = size-sizeof(*header);
       int rc = tjDecompress2((tjhandle)decompressor, (unsigned char *)(header+1),
-                              message->size()-sizeof(*header),
-                              (unsigned char*)tile.pixels.data(),
+                              jpegSize,
+                              (unsigned char*)tile.pixels,
                               tile.size().x,tile.pitch*sizeof(int), tile.size().y,
                               TJPF_RGBX, 0);
+      if (rc != 0)
+        throw std::runtime_error(std::string("JpegTileDecoder: ")+tjGetErrorStr());
 
       // jpeg_mem_src(&cinfo, (unsigned char *)(header+1),
       //              message->size()-sizeof(*header));
@@ -181,12 +1462,89 @@ namespace dw2 {
     // struct jpeg_error_mgr jerr;
   };
   
-  TileEncoder::SP TileEncoder::create() { return std::make_shared<JpegTileEncoder>(); }
-  TileDecoder::SP TileDecoder::create() { return std::make_shared<JpegTileDecoder>(); }
-#else
-  TileEncoder::SP TileEncoder::create() { return std::make_shared<PlainTileEncoder>(); }
-  TileDecoder::SP TileDecoder::create() { return std::make_shared<PlainTileDecoder>(); }
 #endif
+
+  /*! the codecs this build can encode and decode, in the order we
+    prefer them in; the ones that are not general come last */
+  std::vector<int> supportedCodecs()
+  {
+    std::vector<int> codecs;
+#if TURBO_JPEG
+    codecs.push_back(CODEC_JPEG);
+#endif
+    codecs.push_back(CODEC_TEMPORAL);
+    codecs.push_back(CODEC_LOSSLESS);
+    codecs.push_back(CODEC_BLOCK);
+    codecs.push_back(CODEC_PLAIN);
+    codecs.push_back(CODEC_SOLID);
+    codecs.push_back(CODEC_PALETTE);
+    return codecs;
+  }
+
+  TileEncoder::SP TileEncoder::create(int codec, ReferenceTiles::SP references)
+  {
+    switch (codec) {
+    case CODEC_PLAIN:    return std::make_shared<PlainTileEncoder>();
+    case CODEC_LOSSLESS: return std::make_shared<LosslessTileEncoder>();
+    case CODEC_TEMPORAL: return std::make_shared<TemporalTileEncoder>(references);
+    case CODEC_BLOCK:    return std::make_shared<BlockTileEncoder>();
+    case CODEC_SOLID:    return std::make_shared<SolidTileEncoder>();
+    case CODEC_PALETTE:  return std::make_shared<PaletteTileEncoder>();
+#if TURBO_JPEG
+    case CODEC_JPEG:     return std::make_shared<JpegTileEncoder>();
+#endif
+    default:
+      throw std::runtime_error("TileEncoder::create: codec #"+std::to_string(codec)
+                               +" not supported by this build");
+    }
+  }
+
+  /*! looks at every message's codec, and hands it to a decoder for
+      that codec; those get created on first use */
+  struct CodecDispatchingDecoder : public TileDecoder {
+    CodecDispatchingDecoder(ReferenceTiles::SP references)
+      : references(references)
+    {}
+    
+    virtual void decode(PlainTile &tile,
+                        Mailbox::Message::SP message,
+                        size_t offset, size_t size) override
+    {
+      const int codec = ((const TileMessageDataHeader *)(message->data()+offset))->codec;
+      if (codec < 0 || codec >= NUM_CODECS)
+        throw std::runtime_error("TileDecoder: invalid codec #"+std::to_string(codec));
+      if (!decoders[codec])
+        decoders[codec] = createFor(codec,references);
+      decoders[codec]->decode(tile,message,offset,size);
+    }
+
+    static TileDecoder::SP createFor(int codec, ReferenceTiles::SP references)
+    {
+      switch (codec) {
+      case CODEC_PLAIN:    return std::make_shared<PlainTileDecoder>();
+      case CODEC_LOSSLESS: return std::make_shared<LosslessTileDecoder>();
+      case CODEC_TEMPORAL:
+        if (!references)
+          throw std::runtime_error("TileDecoder: temporal tiles need reference tiles");
+        return std::make_shared<TemporalTileDecoder>(references);
+      case CODEC_BLOCK:    return std::make_shared<BlockTileDecoder>();
+      case CODEC_SOLID:    return std::make_shared<SolidTileDecoder>();
+      case CODEC_PALETTE:  return std::make_shared<PaletteTileDecoder>();
+#if TURBO_JPEG
+      case CODEC_JPEG:     return std::make_shared<JpegTileDecoder>();
+#endif
+      default:
+        throw std::runtime_error("TileDecoder: codec #"+std::to_string(codec)
+                                 +" not supported by this build");
+      }
+    }
+    
+    ReferenceTiles::SP references;
+    TileDecoder::SP    decoders[NUM_CODECS];
+  };
+  
+  TileDecoder::SP TileDecoder::create(ReferenceTiles::SP references)
+  { return std::make_shared<CodecDispatchingDecoder>(references); }
   
 } // ::dw2
 
@@ -18,37 +18,151 @@
 
 #include "vec.h"
 #include "Mailbox.h"
+#include "SocketGroup.h"
 //std
 #include <vector>
+#include <array>
+#include <map>
 
 namespace dw2 {
 
+  /*! the codecs a tile message can be encoded with. Every tile
+      message's header says which one it uses, so client and display
+      only have to agree on the set of codecs they both support (see
+      ServiceInfo::codecs), not on a single one */
+  typedef enum {
+    /*! uncompressed RGBA8 pixels */
+    CODEC_PLAIN = 0,
+    /*! libjpeg-turbo; only available if built with USE_TURBO_JPEG */
+    CODEC_JPEG  = 1,
+    /*! lossless: predicted pixels, split into byte planes, then
+        LZ-compressed; pixel-exact, and fast enough for links where
+        jpeg encoding would be the bottleneck */
+    CODEC_LOSSLESS = 2,
+    /*! lossless, and relative to what the same region showed in
+        the frame before wherever that pays off; see ReferenceTiles */
+    CODEC_TEMPORAL = 3,
+    /*! lossy, and fixed-rate: every 4x4 block of pixels becomes two
+        16-bit end-point colors and a 2-bit index per pixel (as in
+        BC1/DXT1 textures), ie, 4 bits per pixel whatever the
+        content. The size of an encoded tile is known before
+        encoding it (see blockCodecMessageSize()), and decoding is
+        much cheaper than jpeg's */
+    CODEC_BLOCK = 4,
+    /*! the whole tile is one color, and that is all the message
+        carries. Not general: only for tiles that classifyTile()
+        picked it for */
+    CODEC_SOLID = 5,
+    /*! a palette of the tile's colors, plus one index per pixel,
+        bit-packed and LZ-compressed; lossless. Not general: only for
+        tiles that classifyTile() picked it for */
+    CODEC_PALETTE = 6,
+    NUM_CODECS
+  } TileCodec;
+
+  /*! the codecs this build can encode and decode, in the order we
+      prefer them in; the ones that are not general (see
+      isGeneralCodec()) come last */
+  std::vector<int> supportedCodecs();
+
+  /*! whether the given codec can encode any tile; the others can
+      only encode tiles that classifyTile() picked them for */
+  inline bool isGeneralCodec(int codec)
+  { return codec != CODEC_SOLID && codec != CODEC_PALETTE; }
+
+  /*! whether the given codec loses information, ie, whether tiles
+      sent with it are worth refining (see
+      TileMessageDataHeader::REFINEMENT) */
+  inline bool isLossy(int codec) { return codec == CODEC_JPEG || codec == CODEC_BLOCK; }
+
+  /*! size of the message that a tile of given size encodes to with
+      CODEC_BLOCK, header included */
+  size_t blockCodecMessageSize(const vec2i &tileSize);
+
   /*! the header we will find in any tile message - it's the sernders
       job to make sure that's the case. inhertif from
       timestampedmessage to get the frameID we need for tile sorting,
       then add the tile region and eye info */
   struct TileMessageDataHeader : public TimeStampedMailbox::TileStampedMessageHeader {
+    /*! flags for the 'flags' field */
+    typedef enum {
+      /*! the tile's pixels are exactly what this region (and eye)
+          showed in the previous frame; the message carries no
+          pixels, the display just keeps what it has */
+      UNCHANGED = 1,
+      /*! this is not a tile, but a container of several tile
+          messages of the same frame (see packTiles()); 'region' is
+          the bounding box (in native pixels) of all of them */
+      CONTAINER = 2,
+      /*! a lossless version of a tile the display already has a
+          lossy version of, from frame 'frameID'; the display puts it
+          in place of the lossy pixels if the region has not changed
+          since. Refinements do not belong to any frame being
+          assembled; a container either holds only refinements (and
+          then has this flag, too), or none at all */
+      REFINEMENT = 4
+    } Flag;
+    
+    /*! region of the wall this tile covers, in coordinates of a
+        wall that was rendered at 1/scale of the native resolution
+        (per axis) */
     box2i region;
     int eye;
+    int flags;
+    /*! render scale the tile was rendered at; 1 for native
+        resolution, 2 for half resolution along each axis, etc */
+    int scale;
+    /*! the TileCodec the tile's payload is encoded with */
+    int codec;
+
+    /*! the region (in native wall pixels) this tile ends up
+        covering once upscaled */
+    inline box2i nativeRegion() const
+    { return box2i(region.lower*vec2i(scale),region.upper*vec2i(scale)); }
   };
+
+  /*! whether the given tile message (or container) is a refinement;
+      see TileMessageDataHeader::REFINEMENT */
+  inline bool isRefinement(const Mailbox::Message &message)
+  { return ((const TileMessageDataHeader *)message.data())->flags & TileMessageDataHeader::REFINEMENT; }
   
-  /*! a plain, uncompressed tile */
+  /*! whether decoding the given tile message (not a container)
+      needs what the display got for the frame before: the pixels of
+      an UNCHANGED tile, or the reference tile of a temporal one */
+  bool needsFrameBefore(const TileMessageDataHeader *header);
+  
+  /*! a plain, uncompressed tile. The pixels usually live in a tile
+      message, right behind the (not yet filled-in) message header, so
+      that a plain encoder can ship that message without copying
+      anything; but a tile can also just refer to pixels owned by
+      somebody else (eg, a sub-region of another tile) */
   struct PlainTile 
   {
     typedef std::shared_ptr<PlainTile> SP;
     
-    void alloc(const box2i &region, int eye)
-      // : pitch(tileSize.x),
-      //   pixel(new uint32_t [tileSize.x*tileSize.y])1
-    {
-      this->region = region;
-      this->eye = eye;
-      pixels.resize(region.size().x*region.size().y);
-      pitch = region.size().x;
-    }
+    /*! (re-)allocate pixel storage for given region. The previous
+        storage gets re-used if nobody else still holds on to it;
+        otherwise, we get a new one from the pool (if provided) */
+    void alloc(const box2i &region, int eye, MessagePool *pool = nullptr);
+
+    /*! use the given message as pixel storage for given region; the
+        message has to be (at least) storageSize(region) bytes */
+    void attach(const box2i &region, int eye, Mailbox::Message::SP storage);
+
+    /*! size of a message that can hold the pixels for given region */
+    static size_t storageSize(const box2i &region);
 
     inline vec2i size() const { return region.size(); }
 
+    /*! a tile that refers to the given sub-region of this tile's
+        pixels (without copying them); 'subRegion' has to lie inside
+        this tile's region */
+    PlainTile subTile(const box2i &subRegion) const;
+
+    /*! a fast 64-bit hash of this tile's pixels - only the pixels,
+        not the region or eye */
+    uint64_t hash() const;
+    
     /*! region of pixels that this tile corresponds to */
     box2i     region;
     /*! number of ints in pixel[] buffer from one y to y+1 */
@@ -57,29 +171,177 @@ namespace dw2 {
     int       eye   { 0 };
     /*! the frame that this tile belongs to */
     int       frameID { -1 };
+    /*! render scale this tile's region refers to; see
+        TileMessageDataHeader::scale */
+    int       scale { 1 };
     /*! pointer to buffer of pixels; this buffer is 'pitch' int-sized pixels wide */
-    std::vector<uint32_t> pixels;
+    uint32_t *pixels { nullptr };
+    /*! the message that owns the pixels; null if the pixels are owned
+        by somebody else. A sub-tile may set this to the storage of
+        the tile it is part of, to keep that alive */
+    Mailbox::Message::SP storage;
+  };
+
+  /*! a pool of plain tiles that renderer threads can write into, and
+      that the encoders hand back once they are done with them */
+  struct PlainTilePool {
+    /*! get a tile for given region, with storage already allocated */
+    PlainTile::SP get(const box2i &region, int eye, int frameID);
+
+    /*! get 'count' tiles at once, one for each of the given regions;
+        takes each of the pool's locks only once */
+    void get(PlainTile::SP *tiles, const box2i *regions, size_t count,
+             int eye, int frameID);
+
+    /*! get 'count' tiles that refer to the given sub-regions of
+        'tile's pixels (see PlainTile::subTile()), each keeping its
+        storage alive; takes the pool's lock only once */
+    void getSubTiles(PlainTile::SP *subTiles, const PlainTile &tile,
+                     const box2i *subRegions, size_t count);
+
+    /*! give a tile back to the pool */
+    void release(PlainTile::SP tile);
+    
+  private:
+    std::mutex                 mutex;
+    std::vector<PlainTile::SP> freeTiles;
+    /*! where the tiles' pixel storage comes from */
+    MessagePool                storage;
   };
 
 
+  /*! the tiles of every region (and eye, and render scale) that
+      went through a temporal encoder, respectively decoder, one per
+      frame until prune()d; the next frame's tile for the same region
+      gets encoded relative to the one of the frame before. Client
+      and display each keep their own, and since either sees the same
+      tiles for the same frames, they agree on what the reference for
+      any region and frame is - even if the display decodes the
+      frames in flight out of order */
+  struct ReferenceTiles {
+    typedef std::shared_ptr<ReferenceTiles> SP;
 
+    /*! look up the reference for given tile's region from frame
+        'frameID', and return it in 'reference'; returns whether
+        there was one */
+    bool get(const PlainTile &tile, int frameID, PlainTile &reference);
+
+    /*! make given tile the reference for its region in its frame.
+        The tile has to own its pixels, and nobody may change them
+        any more */
+    void set(const PlainTile &tile);
+
+    /*! the tile for given region in frame 'frameID' is the same as
+        in the frame before (see makeUnchangedTileMessage()); so if
+        there is a reference from that frame before, it also is the
+        reference for 'frameID' */
+    void touch(const box2i &region, int eye, int scale, int frameID);
+
+    /*! forget about all references older than the given frame */
+    void prune(int oldestFrameID);
+
+  private:
+    /*! (lower.x,lower.y,upper.x,upper.y,eye,scale) */
+    typedef std::array<int,6> Key;
+    static inline Key keyOf(const box2i &region, int eye, int scale)
+    { return {{ region.lower.x, region.lower.y, region.upper.x, region.upper.y, eye, scale }}; }
+    
+    std::mutex                             mutex;
+    /*! per region: the reference of every frame we still have */
+    std::map<Key,std::map<int,PlainTile>>  tiles;
+  };
+  
+  /*! create the (pixel-less) message that tells the display that
+      given tile is the same as in the previous frame */
+  Mailbox::Message::SP makeUnchangedTileMessage(const PlainTile &tile);
+
+  /*! look at the tile's content, and pick the codec that suits it
+      best: CODEC_SOLID if all its pixels are the same, CODEC_PALETTE
+      if it has only a few colors (compared to its number of pixels),
+      and the given codec for everything else. Cheap for photographic
+      content, where it gives up after a few hundred pixels */
+  int classifyTile(const PlainTile &tile, int photographicCodec);
+
+  /*! knobs a (lossy) encoder may use to trade quality for size;
+      lossless encoders ignore them */
+  struct EncodeParams {
+    typedef enum { CHROMA_444, CHROMA_422, CHROMA_420 } ChromaSubsampling;
+    
+    /*! 1..100, as in jpeg */
+    int               quality     { 75 };
+    ChromaSubsampling subsampling { CHROMA_420 };
+  };
+  
   struct TileEncoder {
     typedef std::shared_ptr<TileEncoder> SP;
     
-    /*! create for one thread to ues */
-    static TileEncoder::SP create();
+    /*! create for one thread to use; throws if this build does not
+        support the given TileCodec. Temporal encoders of the same
+        client all share the same reference tiles */
+    static TileEncoder::SP create(int codec,
+                                  ReferenceTiles::SP references = nullptr);
 
-    virtual Mailbox::Message::SP encode(const PlainTile &tile) = 0;
+    virtual Mailbox::Message::SP encode(const PlainTile &tile,
+                                        const EncodeParams &params) = 0;
 
+    /*! encode with default parameters */
+    Mailbox::Message::SP encode(const PlainTile &tile)
+    { return encode(tile,EncodeParams()); }
+  };
+
+  /*! thrown by a temporal decoder for a tile whose reference tile
+      it does not have (eg, because the tile that would have been the
+      reference came in too late for its frame) */
+  struct MissingReferenceTile : public std::runtime_error {
+    MissingReferenceTile()
+      : std::runtime_error("temporal tile refers to a reference tile we do not have")
+    {}
   };
 
   struct TileDecoder {
     typedef std::shared_ptr<TileDecoder> SP;
     
-    /*! create for one thread to ues */
-    static TileDecoder::SP create();
+    /*! create for one thread to use. The decoder looks at every
+        message's codec, and throws if that is one this build does
+        not support. Temporal tiles need the reference tiles that all
+        decoders of the same display share */
+    static TileDecoder::SP create(ReferenceTiles::SP references = nullptr);
+
+    /*! decode the tile message that is 'size' bytes at 'offset'
+        in given message (which may be a container of several). If
+        the caller has pointed 'plain' to pixels for exactly that
+        tile's region that it does not own (no 'storage'; eg, a part
+        of a frame buffer, with the frame buffer's pitch), the
+        decoder writes the pixels there; otherwise, it points 'plain'
+        to pixels of its own */
+    virtual void decode(PlainTile &plain, Mailbox::Message::SP message,
+                        size_t offset, size_t size) = 0;
+
+    /*! decode a message that holds exactly one tile */
+    void decode(PlainTile &plain, Mailbox::Message::SP message)
+    { decode(plain,message,0,message->size()); }
+  };
+
+  /*! pack the given tile messages (all of the same frame) into one
+      container message: a header with the CONTAINER flag and the
+      number of tiles, then each tile's size and complete message,
+      aligned such that the tiles can be decoded in place */
+  Mailbox::Message::SP packTiles(const uint8_t *const *tiles,
+                                 const size_t *sizes,
+                                 size_t numTiles);
+
+  /*! (offset,size) of every tile message in given container */
+  std::vector<std::pair<size_t,size_t>> packedTiles(const Mailbox::Message &container);
 
-    virtual void decode(PlainTile &plain, Mailbox::Message::SP message) = 0;
+  /*! lets a socket group's send threads pack all tiles of the same
+      frame that queue up for a remote into one container */
+  struct TilePacker : public SocketGroup::Packer {
+    virtual bool canPack(const Mailbox::Message &first,
+                         const Mailbox::Message &next) override;
+    virtual void pack(const std::vector<Mailbox::Message::SP> &messages,
+                      std::vector<uint8_t>     &framing,
+                      std::vector<const void *> &pieces,
+                      std::vector<size_t>      &pieceSizes) override;
   };
   
   // Mailbox::Message::SP encode(void *compressor, const PlainTile &tile);
@@ -0,0 +1,117 @@
+// ======================================================================== //
+// Copyright 2019 Ingo Wald                                                 //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "common.h"
+
+namespace dw2 {
+
+  /*! fast, non-cryptographic 64-bit hash over a stream of bytes, in
+      the style of xxHash64: four independent accumulators that each
+      consume one 8-byte word of every 32-byte stripe, so the compiler
+      can keep all four in flight at once (and vectorize them where
+      the target has 64-bit multiplies). Used to tell whether a tile
+      has changed since the last frame, so this is tuned for speed,
+      not for resistance against anybody trying to cause collisions */
+  struct Hash64 {
+    Hash64(uint64_t seed = 0)
+    {
+      acc[0] = seed + prime1 + prime2;
+      acc[1] = seed + prime2;
+      acc[2] = seed;
+      acc[3] = seed - prime1;
+    }
+
+    /*! feed 'numBytes' more bytes into the hash */
+    void add(const void *data, size_t numBytes)
+    {
+      const uint8_t *in = (const uint8_t *)data;
+      totalBytes += numBytes;
+
+      // top up whatever is left over from the last call first
+      if (numBuffered) {
+        const size_t n = std::min(numBytes,sizeof(buffer)-numBuffered);
+        memcpy(buffer+numBuffered,in,n);
+        numBuffered += n;
+        in += n; numBytes -= n;
+        if (numBuffered < sizeof(buffer)) return;
+        stripe(buffer);
+        numBuffered = 0;
+      }
+
+      for (;numBytes >= sizeof(buffer); in += sizeof(buffer), numBytes -= sizeof(buffer))
+        stripe(in);
+
+      memcpy(buffer,in,numBytes);
+      numBuffered = numBytes;
+    }
+
+    /*! the hash of everything added so far */
+    uint64_t get() const
+    {
+      uint64_t h;
+      if (totalBytes >= sizeof(buffer)) {
+        h = rotl(acc[0],1) + rotl(acc[1],7) + rotl(acc[2],12) + rotl(acc[3],18);
+        for (int i=0;i<4;i++)
+          h = (h ^ round(0,acc[i])) * prime1 + prime4;
+      } else
+        h = acc[2] + prime5;
+      h += totalBytes;
+
+      const uint8_t *in = buffer;
+      size_t left = numBuffered;
+      for (;left >= 8; in += 8, left -= 8)
+        h = rotl(h ^ round(0,load64(in)),27) * prime1 + prime4;
+      for (;left >= 4; in += 4, left -= 4)
+        h = rotl(h ^ (load32(in) * prime1),23) * prime2 + prime3;
+      for (;left > 0; in++, left--)
+        h = rotl(h ^ (*in * prime5),11) * prime1;
+
+      h ^= h >> 33; h *= prime2;
+      h ^= h >> 29; h *= prime3;
+      h ^= h >> 32;
+      return h;
+    }
+
+  private:
+    static const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    static const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    static const uint64_t prime3 = 0x165667B19E3779F9ULL;
+    static const uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+    static const uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+    static inline uint64_t rotl(uint64_t v, int r) { return (v << r) | (v >> (64-r)); }
+    static inline uint64_t round(uint64_t acc, uint64_t v)
+    { return rotl(acc + v * prime2,31) * prime1; }
+    static inline uint64_t load64(const uint8_t *p) { uint64_t v; memcpy(&v,p,8); return v; }
+    static inline uint64_t load32(const uint8_t *p) { uint32_t v; memcpy(&v,p,4); return v; }
+
+    inline void stripe(const uint8_t *in)
+    {
+      acc[0] = round(acc[0],load64(in+ 0));
+      acc[1] = round(acc[1],load64(in+ 8));
+      acc[2] = round(acc[2],load64(in+16));
+      acc[3] = round(acc[3],load64(in+24));
+    }
+
+    uint64_t acc[4];
+    uint8_t  buffer[32];
+    size_t   numBuffered { 0 };
+    uint64_t totalBytes  { 0 };
+  };
+
+} // ::dw2
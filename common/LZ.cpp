@@ -0,0 +1,200 @@
+// ======================================================================== //
+// Copyright 2019 Ingo Wald                                                 //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#include "LZ.h"
+
+namespace dw2 {
+
+  /*! like in lz4, a match is at least that long ... */
+  static const size_t minMatch     = 4;
+  /*! ... the last that many bytes are always literals ... */
+  static const size_t lastLiterals = 5;
+  /*! ... and no match starts in the last that many bytes */
+  static const size_t matchStartLimit = 12;
+  static const size_t maxOffset    = 65535;
+  
+  static inline uint32_t load32(const uint8_t *p) { uint32_t v; memcpy(&v,p,4); return v; }
+  static inline uint64_t load64(const uint8_t *p) { uint64_t v; memcpy(&v,p,8); return v; }
+
+  /*! length of the match between 'a' and 'b', not going beyond
+      'aEnd' */
+  static inline size_t matchLength(const uint8_t *a, const uint8_t *b,
+                                   const uint8_t *aEnd)
+  {
+    const uint8_t *begin = a;
+    while (a+8 <= aEnd && load64(a) == load64(b)) { a += 8; b += 8; }
+    while (a < aEnd && *a == *b) { a++; b++; }
+    return a - begin;
+  }
+
+  /*! write a length that did not fit into its 4 bits of the token */
+  static inline uint8_t *writeLength(uint8_t *op, size_t length)
+  {
+    for (;length >= 255;length -= 255)
+      *op++ = 255;
+    *op++ = (uint8_t)length;
+    return op;
+  }
+
+  /*! write literals [anchor,ip), and (if ip isn't the end) the
+      match that follows them */
+  static inline uint8_t *writeSequence(uint8_t *op,
+                                       const uint8_t *anchor, const uint8_t *ip,
+                                       size_t offset, size_t length)
+  {
+    uint8_t *token = op++;
+    const size_t numLiterals = ip - anchor;
+    if (numLiterals >= 15) {
+      *token = 15<<4;
+      op = writeLength(op,numLiterals-15);
+    } else
+      *token = uint8_t(numLiterals<<4);
+    memcpy(op,anchor,numLiterals);
+    op += numLiterals;
+    
+    if (length == 0)
+      // the last sequence: literals only
+      return op;
+
+    *op++ = uint8_t(offset);
+    *op++ = uint8_t(offset>>8);
+    length -= minMatch;
+    if (length >= 15) {
+      *token |= 15;
+      op = writeLength(op,length-15);
+    } else
+      *token |= uint8_t(length);
+    return op;
+  }
+
+  /*! compress 'numBytes' bytes from 'in' to 'out' */
+  size_t LZCompressor::compress(uint8_t *out, const uint8_t *in, size_t numBytes)
+  {
+    const uint8_t *ip     = in;
+    const uint8_t *anchor = in;
+    const uint8_t *end    = in + numBytes;
+    uint8_t       *op     = out;
+
+    if (numBytes > matchStartLimit) {
+      memset(table,0,sizeof(table));
+      const uint8_t *matchLimit = end - lastLiterals;
+      const uint8_t *startLimit = end - matchStartLimit;
+      // the longer we do not find anything, the bigger the steps we
+      // take - data that does not compress should not cost much
+      // time either
+      size_t numMisses = 0;
+      while (ip < startLimit) {
+        const uint32_t sequence = load32(ip);
+        const uint32_t hash     = (sequence * 2654435761U) >> (32-hashLog);
+        const uint8_t *ref      = in + table[hash];
+        table[hash] = uint32_t(ip - in);
+        if (ref >= ip || size_t(ip - ref) > maxOffset || load32(ref) != sequence) {
+          ip += 1 + (numMisses++ >> 6);
+          continue;
+        }
+        numMisses = 0;
+        
+        // we might have missed the start of the match
+        while (ip > anchor && ref > in && ip[-1] == ref[-1]) { ip--; ref--; }
+        const size_t length = minMatch + matchLength(ip+minMatch,ref+minMatch,matchLimit);
+        op = writeSequence(op,anchor,ip,ip-ref,length);
+        ip += length;
+        anchor = ip;
+      }
+    }
+    op = writeSequence(op,anchor,end,0,0);
+    assert(size_t(op-out) <= bound(numBytes));
+    return op - out;
+  }
+
+  /*! read a length that did not fit into its 4 bits of the token */
+  static inline bool readLength(const uint8_t *&ip, const uint8_t *end, size_t &length)
+  {
+    while (1) {
+      if (ip >= end) return false;
+      const uint8_t b = *ip++;
+      length += b;
+      if (b != 255) return true;
+    }
+  }
+  
+  /*! copy 'length' bytes in chunks of 'chunk' bytes, possibly
+      writing up to chunk-1 bytes past the end; 'src' has to be at
+      least 'chunk' bytes before 'dst' if they overlap */
+  template<int chunk>
+  static inline void wildCopy(uint8_t *dst, const uint8_t *src, size_t length)
+  {
+    uint8_t *end = dst + length;
+    do { memcpy(dst,src,chunk); dst += chunk; src += chunk; } while (dst < end);
+  }
+  
+  /*! decompress what LZCompressor::compress() produced */
+  bool lzDecompress(uint8_t *out, size_t outSize,
+                    const uint8_t *in, size_t inSize)
+  {
+    const uint8_t *ip   = in;
+    const uint8_t *iend = in + inSize;
+    uint8_t       *op   = out;
+    uint8_t       *oend = out + outSize;
+    
+    while (1) {
+      if (ip >= iend) return false;
+      const uint8_t token = *ip++;
+
+      size_t numLiterals = token >> 4;
+      if (numLiterals == 15 && !readLength(ip,iend,numLiterals))
+        return false;
+      if (numLiterals > size_t(iend-ip) || numLiterals > size_t(oend-op))
+        return false;
+      if (numLiterals <= 16 && iend-ip >= 16 && oend-op >= 16)
+        // the common case of few literals, far from either end
+        memcpy(op,ip,16);
+      else
+        memcpy(op,ip,numLiterals);
+      op += numLiterals;
+      ip += numLiterals;
+      if (ip == iend)
+        // the last sequence has no match
+        return op == oend;
+
+      if (iend-ip < 2) return false;
+      const size_t offset = ip[0] | (size_t(ip[1]) << 8);
+      ip += 2;
+      if (offset == 0 || offset > size_t(op-out)) return false;
+      
+      size_t length = token & 15;
+      if (length == 15 && !readLength(ip,iend,length))
+        return false;
+      length += minMatch;
+      if (length > size_t(oend-op)) return false;
+
+      const uint8_t *match = op - offset;
+      const bool farFromEnd = size_t(oend-op) >= length+16;
+      if (offset >= 16 && farFromEnd)
+        wildCopy<16>(op,match,length);
+      else if (offset >= 8 && farFromEnd)
+        wildCopy<8>(op,match,length);
+      else if (offset == 1)
+        // a run of the same byte; very common in byte planes
+        memset(op,*match,length);
+      else
+        // close to the end, or source and destination overlap
+        for (size_t i=0;i<length;i++) op[i] = match[i];
+      op += length;
+    }
+  }
+  
+} // ::dw2
@@ -0,0 +1,54 @@
+// ======================================================================== //
+// Copyright 2019 Ingo Wald                                                 //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "common.h"
+
+namespace dw2 {
+
+  /*! a byte-oriented LZ77 compressor that writes the LZ4 block
+      format: each sequence is a token (4 bits of literal length, 4
+      bits of match length), the literals, and a 16-bit offset back
+      into what was already decoded. No entropy coding at all, which
+      is what makes it run at GB/s - it only pays off on data that
+      has long repeats, so feed it something that does (eg, residuals
+      of a good predictor, split into byte planes).
+
+      One compressor per thread; it holds the match finder's hash
+      table so that does not have to live on the stack */
+  struct LZCompressor {
+    /*! max size compressing 'numBytes' bytes can ever produce */
+    static inline size_t bound(size_t numBytes)
+    { return numBytes + numBytes/255 + 16; }
+
+    /*! compress 'numBytes' bytes from 'in' to 'out', which has to
+        have room for bound(numBytes) bytes; returns the compressed
+        size */
+    size_t compress(uint8_t *out, const uint8_t *in, size_t numBytes);
+
+  private:
+    static const int hashLog = 12;
+    uint32_t table[1<<hashLog];
+  };
+
+  /*! decompress what LZCompressor::compress() produced; returns
+      false (rather than reading or writing out of bounds) if 'in' is
+      not exactly one stream that decodes to exactly 'outSize' bytes */
+  bool lzDecompress(uint8_t *out, size_t outSize,
+                    const uint8_t *in, size_t inSize);
+  
+} // ::dw2
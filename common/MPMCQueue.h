@@ -0,0 +1,302 @@
+// ======================================================================== //
+// Copyright 2019 Ingo Wald                                                 //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+#pragma once
+
+#include "common.h"
+// std
+#include <atomic>
+#include <condition_variable>
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace dw2 {
+
+  /*! hint to the cpu that we're in a spin-wait loop */
+  inline void spinPause()
+  {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  /*! a bounded multi-producer/multi-consumer queue, after Dmitry
+      Vyukov's design: each slot carries a sequence number that tells
+      producers and consumers whether that slot is theirs to fill or
+      to drain, so neither side ever takes a lock on the fast path.
+
+      push() and pop() block while the queue is full or empty,
+      respectively; they first spin for a short while (most waits
+      are short when tiles stream in), and only then park the thread
+      on a condition variable. Parking and waking is the only place
+      that touches a mutex, and it only happens if somebody actually
+      sleeps. */
+  template<typename T>
+  struct MPMCQueue {
+    /*! create a queue with (at least) the given number of slots;
+        gets rounded up to the next power of two */
+    MPMCQueue(size_t minCapacity = 4096)
+    {
+      size_t capacity = 2;
+      while (capacity < minCapacity) capacity *= 2;
+      mask  = capacity-1;
+      cells = std::vector<Cell>(capacity);
+      for (size_t i=0;i<capacity;i++)
+        cells[i].sequence.store(i,std::memory_order_relaxed);
+    }
+
+    /*! put an item into the queue; if full, wait until there's space */
+    void push(const T &item)
+    {
+      if (!tryPushSpinning(item))
+        park(producers,[&](){ return tryPush(item); });
+      wake(consumers,1);
+    }
+
+    /*! put 'count' items into the queue, and wake up to that many
+        sleeping consumers at once. Claims as many slots as are free
+        with a single atomic op, so a batch is about as cheap as a
+        single push */
+    void push(const T *items, size_t count)
+    {
+      for (size_t i=0;i<count;) {
+        const size_t numPushed = tryPushMany(items+i,count-i);
+        if (numPushed) { i += numPushed; continue; }
+        if (tryPushSpinning(items[i])) { ++i; continue; }
+        // let consumers drain what we have pushed so far
+        wake(consumers,i);
+        park(producers,[&](){ return tryPush(items[i]); });
+        ++i;
+      }
+      wake(consumers,count);
+    }
+
+    /*! non-blocking put of as many of the 'count' items (in order)
+        as fit right now, waking up to that many sleeping consumers;
+        returns how many that were */
+    size_t tryPush(const T *items, size_t count)
+    {
+      size_t numPushed = 0;
+      while (numPushed < count) {
+        const size_t n = tryPushMany(items+numPushed,count-numPushed);
+        if (!n) break;
+        numPushed += n;
+      }
+      wake(consumers,numPushed);
+      return numPushed;
+    }
+
+    /*! non-blocking put of up to 'count' items into consecutive
+        slots; returns how many were pushed (0 if the queue is full) */
+    size_t tryPushMany(const T *items, size_t count)
+    {
+      size_t pos = enqueuePos.load(std::memory_order_relaxed);
+      size_t numFree;
+      while (1) {
+        // slots can only go from free to used by a producer claiming
+        // them through enqueuePos, so if the CAS below succeeds all
+        // the slots we saw free are still free - and ours
+        const intptr_t dif
+          = (intptr_t)cells[pos & mask].sequence.load(std::memory_order_acquire)
+          - (intptr_t)pos;
+        if (dif < 0)
+          return 0;
+        if (dif > 0) {
+          // somebody else pushed meanwhile
+          pos = enqueuePos.load(std::memory_order_relaxed);
+          continue;
+        }
+        numFree = 1;
+        while (numFree < count && numFree <= mask
+               && cells[(pos+numFree) & mask].sequence.load(std::memory_order_acquire)
+               == pos+numFree)
+          ++numFree;
+        if (enqueuePos.compare_exchange_weak(pos,pos+numFree,std::memory_order_relaxed))
+          break;
+      }
+      for (size_t i=0;i<numFree;i++) {
+        Cell &cell = cells[(pos+i) & mask];
+        cell.item = items[i];
+        cell.sequence.store(pos+i+1,std::memory_order_release);
+      }
+      return numFree;
+    }
+
+    /*! get the next item; if empty, wait until one arrives */
+    T pop()
+    {
+      T item;
+      if (!tryPopSpinning(item))
+        park(consumers,[&](){ return tryPop(item); });
+      wake(producers,1);
+      return item;
+    }
+
+    /*! non-blocking put; returns false if the queue is full */
+    bool tryPush(const T &item)
+    {
+      Cell *cell;
+      size_t pos = enqueuePos.load(std::memory_order_relaxed);
+      while (1) {
+        cell = &cells[pos & mask];
+        const size_t seq = cell->sequence.load(std::memory_order_acquire);
+        const intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+          if (enqueuePos.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+            break;
+        } else if (dif < 0)
+          return false;
+        else
+          pos = enqueuePos.load(std::memory_order_relaxed);
+      }
+      cell->item = item;
+      cell->sequence.store(pos+1,std::memory_order_release);
+      return true;
+    }
+
+    /*! non-blocking get; returns false if the queue is empty */
+    bool tryPop(T &item)
+    {
+      Cell *cell;
+      size_t pos = dequeuePos.load(std::memory_order_relaxed);
+      while (1) {
+        cell = &cells[pos & mask];
+        const size_t seq = cell->sequence.load(std::memory_order_acquire);
+        const intptr_t dif = (intptr_t)seq - (intptr_t)(pos+1);
+        if (dif == 0) {
+          if (dequeuePos.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+            break;
+        } else if (dif < 0)
+          return false;
+        else
+          pos = dequeuePos.load(std::memory_order_relaxed);
+      }
+      item = std::move(cell->item);
+      // make sure the slot doesn't keep a reference alive
+      cell->item = T();
+      cell->sequence.store(pos+mask+1,std::memory_order_release);
+      return true;
+    }
+
+    /*! whether the queue is empty - only a snapshot, of course */
+    bool empty() const
+    {
+      return
+        dequeuePos.load(std::memory_order_relaxed)
+        >= enqueuePos.load(std::memory_order_relaxed);
+    }
+
+  private:
+    /*! number of times we retry before parking the thread; spinning
+        only makes sense if somebody else can make progress meanwhile */
+    static int numSpins()
+    {
+      static const int n = std::thread::hardware_concurrency() > 1 ? 256 : 0;
+      return n;
+    }
+
+    bool tryPushSpinning(const T &item)
+    {
+      if (tryPush(item)) return true;
+      for (int i=0;i<numSpins();i++) {
+        if (tryPush(item)) return true;
+        spinPause();
+      }
+      return false;
+    }
+
+    bool tryPopSpinning(T &item)
+    {
+      if (tryPop(item)) return true;
+      for (int i=0;i<numSpins();i++) {
+        if (tryPop(item)) return true;
+        spinPause();
+      }
+      return false;
+    }
+
+    /*! threads parked on one side of the queue (producers waiting
+        for space, or consumers waiting for items) */
+    struct ParkingLot {
+      std::atomic<int>        numSleeping { 0 };
+      /*! number of sleepers that have already been notified, but not
+          woken up yet - so we don't keep notifying (and taking the
+          mutex) for threads that are already on their way */
+      std::atomic<int>        numNotified { 0 };
+      std::condition_variable cv;
+    };
+
+    /*! park the calling thread until 'tryAgain' succeeds */
+    template<typename TryAgain>
+    void park(ParkingLot &lot, TryAgain &&tryAgain)
+    {
+      std::unique_lock<std::mutex> lock(parkMutex);
+      lot.numSleeping.fetch_add(1);
+      // pairs with the fence in wake(): either we see the other
+      // side's update to the queue, or it sees us sleeping
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while (!tryAgain()) {
+        lot.cv.wait(lock);
+        if (lot.numNotified.load(std::memory_order_relaxed) > 0)
+          lot.numNotified.fetch_sub(1);
+      }
+      lot.numSleeping.fetch_sub(1);
+    }
+
+    /*! wake up to 'count' threads parked in given lot, if there are
+        any that are not already being woken up */
+    void wake(ParkingLot &lot, size_t count)
+    {
+      if (count == 0) return;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (lot.numSleeping.load(std::memory_order_relaxed)
+          <= lot.numNotified.load(std::memory_order_relaxed))
+        return;
+      
+      std::lock_guard<std::mutex> lock(parkMutex);
+      const int numSleeping = lot.numSleeping.load(std::memory_order_relaxed);
+      const int numNotified = lot.numNotified.load(std::memory_order_relaxed);
+      const int numToWake   = std::min((int)count,numSleeping-numNotified);
+      for (int i=0;i<numToWake;i++) {
+        lot.numNotified.fetch_add(1);
+        lot.cv.notify_one();
+      }
+    }
+
+    struct Cell {
+      Cell() {}
+      Cell(const Cell &) {}
+      std::atomic<size_t> sequence;
+      T                   item;
+    };
+
+    std::vector<Cell> cells;
+    size_t            mask;
+
+    /*! producers and consumers each hammer on their own position, so
+        keep those in separate cache lines */
+    alignas(64) std::atomic<size_t> enqueuePos { 0 };
+    alignas(64) std::atomic<size_t> dequeuePos { 0 };
+
+    alignas(64) ParkingLot          consumers;
+    ParkingLot                      producers;
+    std::mutex                      parkMutex;
+  };
+
+} // ::dw2
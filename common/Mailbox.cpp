@@ -18,23 +18,19 @@
 
 namespace dw2 {
 
-  /*! put a new message into the mailbox - if it matches the current
-    frame put it into the active queue and notify any potential
-    waiters; otherwise defer the message by putting it into the
-    futureFrameMessages vector */
+  /*! put a new message into the mailbox, and notify whoever may be
+    waiting for one */
   void Mailbox::put(Mailbox::Message::SP newMessage)
   {
-    std::lock_guard<std::mutex> lock(mutex);
     locked_put(newMessage);
   }
-  /*! put a new message into the mailbox - if it matches the current
-    frame put it into the active queue and notify any potential
-    waiters; otherwise defer the message by putting it into the
-    futureFrameMessages vector */
+  
+  /*! the actual core of the put() method; the message queue itself
+    does not need any lock, but derived mailboxes may call this with
+    their mutex already locked */
   void Mailbox::locked_put(Mailbox::Message::SP newMessage)
   {
-    messages.push_back(newMessage);
-    newMessageAvailable.notify_all();
+    messages.push(newMessage);
   }
 
   /*! get next message that's ready for processing. if no messages
@@ -43,45 +39,135 @@ namespace dw2 {
     messages for that new frame arrive */
   Mailbox::Message::SP Mailbox::get()
   {
-    std::unique_lock<std::mutex> lock(mutex);
-    while (messages.empty())
-      newMessageAvailable.wait(lock);
-
-    auto ret = messages.front();
-    messages.pop_front();
-    //    std::cout << "found message in queue, size = " << ret->size() << "\n";
-    return ret;
+    return messages.pop();
+  }
+
+
+  /*! get a message with given size; its content is undefined */
+  Mailbox::Message::SP MessagePool::get(size_t size)
+  {
+    Mailbox::Message::SP message;
+    get(&message,&size,1);
+    return message;
+  }
+
+  /*! get 'count' messages at once, taking the pool's lock only once */
+  void MessagePool::get(Mailbox::Message::SP *out, const size_t *sizes, size_t count)
+  {
+    // number of pooled messages we look at before giving up and
+    // allocating a new one
+    const size_t maxProbes = 4;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i=0;i<count;i++) {
+      out[i] = nullptr;
+      for (size_t probe=0;probe<std::min(maxProbes,messages.size());probe++) {
+        Mailbox::Message::SP &candidate = messages[nextToCheck];
+        nextToCheck = (nextToCheck+1) % messages.size();
+        // only the pool itself holds this one, so nobody else can
+        // possibly get a new reference to it - safe to re-use
+        if (candidate.use_count() == 1) {
+          candidate->resize(sizes[i]);
+          out[i] = candidate;
+          break;
+        }
+      }
+      if (out[i]) continue;
+      
+      out[i] = std::make_shared<Mailbox::Message>();
+      out[i]->resize(sizes[i]);
+      if (messages.size() < maxMessages) {
+        out[i]->pooled = true;
+        messages.push_back(out[i]);
+      }
+    }
   }
 
 
   
-  /*! start a new frame, and rec-onsider al future frame messages
-    that we have already received */
+  /*! start a new frame, and let through the future frame messages
+    that we have already received for the frames that are in flight
+    now */
   void TimeStampedMailbox::startNewFrame(int frameID)
   {
-    // ------------------------------------------------------------------
-    // first, retreive the currently delayed messages (so we can
-    // then 're-send' them), and increase frame ID.
-    // ------------------------------------------------------------------
-    
     std::lock_guard<std::mutex> lock(mutex);
-    currentFrameID   = frameID;
-    std::vector<Mailbox::Message::SP> deferredMessages = retrieveDeferredMessages();
-    //std::cout << "#mailbox: starting new frame " << frameID
-	//<< ", reactivating " << deferredMessages.size() << " messages" << "\n";
-  
+    if (frameID <= currentFrameID)
+      return;
+    
+    const int oldFirstDeferred = firstDeferredFrameID();
+    currentFrameID = frameID;
+    const int newFirstDeferred = firstDeferredFrameID();
+    //std::cout << "#mailbox: starting new frame " << frameID << "\n";
+    
     // ------------------------------------------------------------------
-    // now that the new frame is active, re-put all the previously
-    // deferred messages
+    // every bucket of a frame that is in flight now goes to the active
+    // queue in one go; the ones of frames we skipped are stale
     // ------------------------------------------------------------------
-    for (auto message : deferredMessages) 
-      locked_put(message);
+    const double now = getCurrentTime();
+    const int    end = std::min(newFirstDeferred,oldFirstDeferred+(int)buckets.size());
+    for (int f=oldFirstDeferred;f<end;f++) {
+      Bucket &bucket = buckets[f % buckets.size()];
+      if (bucket.messages.empty()) continue;
+
+      const size_t count = bucket.messages.size();
+      stats.numDeferredNow -= count;
+      if (f < currentFrameID)
+        stats.numStale += count;
+      else {
+        stats.numReleased        += count;
+        stats.secondsDeferred    += count*now - bucket.sumOfTimesDeferred;
+        stats.maxSecondsDeferred  = std::max(stats.maxSecondsDeferred,
+                                             now-bucket.earliestTimeDeferred);
+        overflow.insert(overflow.end(),bucket.messages.begin(),bucket.messages.end());
+      }
+      bucket.messages.clear();
+      bucket.sumOfTimesDeferred = 0.;
+    }
+    locked_moveOverflow();
   }
 
+  /*! move as much of 'overflow' to the active queue as fits right
+    now, without waiting */
+  void TimeStampedMailbox::locked_moveOverflow()
+  {
+    if (overflow.empty()) return;
+    // (set before we push, so that whoever pops what is in the queue
+    // now also sees there's more to come)
+    numOverflowing = overflow.size();
+    const size_t numMoved = messages.tryPush(overflow.data(),overflow.size());
+    overflow.erase(overflow.begin(),overflow.begin()+numMoved);
+    numOverflowing = overflow.size();
+  }
+
+  /*! get next message that's ready for processing; wait until one
+    arrives */
+  Mailbox::Message::SP TimeStampedMailbox::get()
+  {
+    Message::SP message = Mailbox::get();
+    if (numOverflowing > 0) {
+      // we just made room for (at least) one of those
+      std::lock_guard<std::mutex> lock(mutex);
+      locked_moveOverflow();
+    }
+    return message;
+  }
 
-  /*! the actual core of the put() method, assuming the mutex is
-    already locked */
-  void TimeStampedMailbox::locked_put(Message::SP newMessage)
+  /*! make the ring of buckets large enough to hold frame 'frameID' */
+  void TimeStampedMailbox::growBuckets(int frameID)
+  {
+    size_t newSize = buckets.size();
+    while (frameID >= firstDeferredFrameID() + (int)newSize)
+      newSize *= 2;
+    std::vector<Bucket> newBuckets(newSize);
+    for (int f=firstDeferredFrameID();f<firstDeferredFrameID()+(int)buckets.size();f++)
+      std::swap(newBuckets[f % newSize],buckets[f % buckets.size()]);
+    buckets.swap(newBuckets);
+  }
+
+  /*! the part of the put() method that needs the mutex locked;
+    returns whether the message still has to go to the active
+    queue */
+  bool TimeStampedMailbox::locked_put(Message::SP newMessage)
   {
     assert(newMessage);
     TileStampedMessageHeader *header = (TileStampedMessageHeader*)newMessage->data();
@@ -96,33 +182,53 @@ namespace dw2 {
           they're guaranteed inactive (else the prev frame could never
           have been completed) it's safe to drop those ... */
       //std::cout << "Yay! Found a stale tile ... how's the chance of _that_!?" << "\n";
-      return;
+      stats.numStale++;
+      return false;
     }
       
-    if (header->frameID == currentFrameID) {
-      Mailbox::locked_put(newMessage);
-    } else {
-      // std::cout << "delaying " << header->frameID << " != " << currentFrameID << "\n";
-      futureFrameMessages.push_back(newMessage);
-    }
+    if (header->frameID < firstDeferredFrameID())
+      return true;
+    
+    // std::cout << "delaying " << header->frameID << " != " << currentFrameID << "\n";
+    if (header->frameID >= firstDeferredFrameID() + (int)buckets.size())
+      growBuckets(header->frameID);
+    Bucket &bucket = buckets[header->frameID % buckets.size()];
+    const double now = getCurrentTime();
+    if (bucket.messages.empty())
+      bucket.earliestTimeDeferred = now;
+    bucket.sumOfTimesDeferred += now;
+    bucket.messages.push_back(newMessage);
+    
+    stats.numDeferred++;
+    stats.numDeferredNow++;
+    stats.maxDeferredAtOnce = std::max(stats.maxDeferredAtOnce,stats.numDeferredNow);
+    return false;
   }
 
-  /*! put a new message into the mailbox - if it matches the current
-    frame put it into the active queue and notify any potential
-    waiters; otherwise defer the message by putting it into the
-    futureFrameMessages vector */
+  /*! put a new message into the mailbox - if it matches a frame in
+    flight put it into the active queue and notify any potential
+    waiters; otherwise defer the message by putting it into its
+    frame's bucket */
   void TimeStampedMailbox::put(Mailbox::Message::SP newMessage)
   {
-    std::lock_guard<std::mutex> lock(mutex);
-    locked_put(newMessage);
+    if (isFrameless && isFrameless(*newMessage)) {
+      // no frame to wait for; and nothing we'd need the lock for
+      Mailbox::locked_put(newMessage);
+      return;
+    }
+    bool isInFlight;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      isInFlight = locked_put(newMessage);
+    }
+    if (isInFlight)
+      // may have to wait for space - not with the lock held
+      Mailbox::locked_put(newMessage);
   }
 
-  /*! retreive - and empty - the vector of future-frame messages - may
-      ONLY be called with the mutex already locked! */
-  std::vector<Mailbox::Message::SP> TimeStampedMailbox::retrieveDeferredMessages()
+  TimeStampedMailbox::DeferralStats TimeStampedMailbox::getDeferralStats()
   {
-    std::vector<Message::SP> rv = futureFrameMessages;
-    futureFrameMessages.clear();
-    return rv;
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
   }
 }
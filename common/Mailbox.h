@@ -17,12 +17,14 @@
 #pragma once
 
 #include "Socket.h"
+#include "MPMCQueue.h"
 
 #include <vector>
 #include <deque>
 #include <stdint.h>
 #include <thread>
 #include <condition_variable>
+#include <functional>
 
 namespace dw2 {
 
@@ -32,7 +34,7 @@ namespace dw2 {
   struct Mailbox {
     typedef std::shared_ptr<Mailbox> SP;
     
-    struct Message : public std::vector<uint8_t>
+    struct Message : public std::vector<uint8_t,NoInitAllocator<uint8_t>>
     {
       typedef std::shared_ptr<Message> SP;
 
@@ -47,63 +49,185 @@ namespace dw2 {
       // const box2i region;
       // Is this used?
       size_t outSize;
-	  std::vector<int> toRank;
+
+      /*! whether a MessagePool holds on to this message (to hand it
+          out again once nobody else does); that's one more reference
+          than its users have */
+      bool   pooled { false };
     };
 
+    /*! create a mailbox that can hold (at least) the given number
+        of messages; put() will wait for space if it is full */
+    Mailbox(size_t capacity = 16*1024) : messages(capacity) {}
+    
     /*! put a new message into the mailbox, and notify whoever may be
         waiting for one */
     virtual void put(Message::SP newMessage);
-    /*! the actual core of the put() method, assuming the mutex is
-        already locked */
+    /*! the actual core of the put() method; the message queue itself
+        does not need any lock, but derived mailboxes may call this
+        with their mutex already locked */
     void locked_put(Message::SP newMessage);
 
     /*! get next message that's ready for processing; y, wait until
         one arrives */
     virtual Message::SP get();
+
+    /*! get next message if there is one right now; returns false
+        (and doesn't wait) if there isn't */
+    bool tryGet(Message::SP &message) { return messages.tryPop(message); }
     
   protected:
-    std::deque<Message::SP>  messages;
+    MPMCQueue<Message::SP>   messages;
+    /*! not needed by the queue itself, but used by derived mailboxes
+        to protect whatever extra state they have */
     std::mutex               mutex;
-    std::condition_variable  newMessageAvailable;
+  };
+
+  /*! a pool of messages that get recycled once nobody but the pool
+      holds on to them any more (eg, once the socket group has written
+      them out, or a frame assembler has decoded them), so that
+      steady-state tile traffic does not need any allocations */
+  struct MessagePool {
+    MessagePool(size_t maxMessages = 1024) : maxMessages(maxMessages) {}
+    
+    /*! get a message with given size; its content is undefined */
+    Mailbox::Message::SP get(size_t size);
+
+    /*! get 'count' messages at once, of sizes[i] bytes each, taking
+        the pool's lock only once */
+    void get(Mailbox::Message::SP *messages, const size_t *sizes, size_t count);
+    
+  private:
+    std::mutex                        mutex;
+    std::vector<Mailbox::Message::SP> messages;
+    /*! round-robin position of the next message we check for being
+        free; the one handed out longest ago is the one most likely to
+        be back */
+    size_t                            nextToCheck = 0;
+    const size_t                      maxMessages;
   };
 
 
   /*! a mailbox whose get() function only let's through messages of
-      the current time stamp, and delays all others until a respective
+      the current time stamp (or, with several frames in flight, of
+      the current and the next few), and delays all others until a respective
       frame with this time stamp has been started. This inherits from
       a regular mailbox, and uses that mailbox's get() function and
       'messages' queue, which means that this messages() queue is a
       queue that contains only messages with current frame ID; we
       realize this by overriding put() to delay messages with future
-      frame IDs, and re-putting deferred messages when a new frame
-      gets started */
+      frame IDs - in one bucket per frame - and moving a frame's
+      bucket over as a whole when that frame gets started.
+
+      The active queue is bounded: put() waits for space in it (which
+      is what pushes back on whoever receives the messages), but never
+      with the mutex locked. Buckets get moved over without waiting;
+      what does not fit waits in 'overflow' until get() makes room */
   struct TimeStampedMailbox : public Mailbox {
     typedef std::shared_ptr<TimeStampedMailbox> SP;
     
     struct TileStampedMessageHeader {
       int frameID;
     };
+
+    /*! tells messages that do not belong to any particular frame
+        (and thus get let through right away, whatever frame is
+        current) from those that do */
+    typedef std::function<bool(const Message &)> IsFramelessFct;
+
+    /*! how many messages got delayed, and for how long */
+    struct DeferralStats {
+      /*! messages deferred so far */
+      uint64_t numDeferred        { 0 };
+      /*! messages deferred right now */
+      size_t   numDeferredNow     { 0 };
+      /*! the most messages that ever were deferred at the same time */
+      size_t   maxDeferredAtOnce  { 0 };
+      /*! messages dropped because their frame was already over */
+      uint64_t numStale           { 0 };
+      /*! deferred messages that got let through since */
+      uint64_t numReleased        { 0 };
+      /*! total (over the numReleased ones) and longest time that
+          messages spent deferred, in seconds */
+      double   secondsDeferred    { 0. };
+      double   maxSecondsDeferred { 0. };
+    };
+    
+    /*! a mailbox that lets through the messages of
+        'numFramesInFlight' frames at once: of the current one, and of
+        as many after it as fit */
+    TimeStampedMailbox(IsFramelessFct isFrameless = nullptr,
+                       int numFramesInFlight = 1)
+      : numFramesInFlight(numFramesInFlight),
+        isFrameless(isFrameless),
+        buckets(std::max(4,2*numFramesInFlight))
+    {}
     
     /*! start a new frame, and rec-onsider al future frame messages
-        that we have already received */
+        that we have already received. Messages of frames [frameID,
+        frameID+numFramesInFlight) get let through from now on */
     void startNewFrame(int frameID);
 
-    /*! put a new message into the mailbox - if it matches the current
-        frame put it into the active queue and notify any potential
-        waiters; otherwise defer the message by putting it into the
-        futureFrameMessages vector */
+    /*! how many frames' messages we let through at once */
+    const int numFramesInFlight;
+
+    /*! put a new message into the mailbox - if it matches a frame in
+        flight put it into the active queue and notify any potential
+        waiters; otherwise defer the message by putting it into its
+        frame's bucket */
     virtual void put(Message::SP newMessage);
 
+    /*! get next message that's ready for processing; wait until one
+        arrives */
+    virtual Message::SP get() override;
+
+    DeferralStats getDeferralStats();
+    
   private:
-    /*! the actual core of the put() method, assuming the mutex is
-        already locked */
-    void locked_put(Message::SP newMessage);
-    std::vector<Message::SP> futureFrameMessages;
+    /*! the messages of one future frame */
+    struct Bucket {
+      std::vector<Message::SP> messages;
+      /*! sum of (and earliest of) the times the messages got
+          deferred at */
+      double                   sumOfTimesDeferred   { 0. };
+      double                   earliestTimeDeferred { 0. };
+    };
     
-    int                      currentFrameID = -1;
+    /*! the part of the put() method that needs the mutex locked:
+        drops stale messages, and defers those of future frames;
+        returns whether the message is for a frame in flight, ie,
+        still has to go to the active queue (which the caller does
+        once it has unlocked the mutex) */
+    bool locked_put(Message::SP newMessage);
+
+    /*! move as much of 'overflow' to the active queue as fits right
+        now, without waiting; mutex has to be locked */
+    void locked_moveOverflow();
+
+    /*! first frame whose messages get deferred */
+    inline int firstDeferredFrameID() const
+    { return currentFrameID + numFramesInFlight; }
     
-    /*! retreive - and empty - the vector of future-frame messages */
-    std::vector<Message::SP> retrieveDeferredMessages();
+    /*! make the ring of buckets large enough to hold frame 'frameID';
+        only ever needed if clients get further ahead than usual */
+    void growBuckets(int frameID);
+    
+    int                      currentFrameID = -1;
+    /*! see IsFramelessFct; may be null */
+    const IsFramelessFct     isFrameless;
+
+    /*! ring of buckets for the frames after the ones in flight:
+        frame f (with firstDeferredFrameID() <= f <
+        firstDeferredFrameID()+buckets.size()) goes into bucket f %
+        buckets.size(). Buckets keep their capacity once emptied, so
+        steady-state deferral does not allocate */
+    std::vector<Bucket>      buckets;
+    /*! messages of frames in flight that did not fit into the
+        active queue yet, in order */
+    std::vector<Message::SP> overflow;
+    /*! overflow.size(), for get() to check without the mutex */
+    std::atomic<size_t>      numOverflowing { 0 };
+    DeferralStats            stats;
   };
   
 } // ::dw2
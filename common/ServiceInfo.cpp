@@ -70,6 +70,12 @@ namespace dw2 {
       read(socket,node.region);
     }
 
+    int numCodecs;
+    read(socket,numCodecs);
+    info->codecs.resize(numCodecs);
+    for (auto &codec : info->codecs)
+      read(socket,codec);
+
 #if 1
     std::cout << "#dw2.client: service info reported the following displays: " << "\n";
     for (int i=0;i<info->nodes.size();i++)
@@ -99,6 +105,10 @@ namespace dw2 {
       write(socket,node.port);
       write(socket,node.region);
     }
+
+    write(socket,(int)codecs.size());
+    for (auto codec : codecs)
+      write(socket,codec);
   }
 
   // void ControlWindowImageInfo::writeTo(sock::socket_t socket)
@@ -41,10 +41,9 @@ namespace dw2 {
     static ServiceInfo::SP getInfo(const std::string hostName, int port);
     
     /*! total pixels in the entire display wall, across all
-      indvididual displays, and including bezels (future versios
-      will allow to render to smaller resolutions, too - and have
-      the clients upscale this - but for now the client(s) have to
-      render at exactly this resolution */
+      indvididual displays, and including bezels. Clients may also
+      render at a fraction of this (see dw2_set_render_scale()), in
+      which case the displays upscale what they get */
     vec2i totalPixelsInWall;
 
     /*! number of displays, just for informational purposes */
@@ -70,6 +69,10 @@ namespace dw2 {
         head node), even though there may be multiple nodes 'behind'
         that head node */
     std::vector<Node> nodes;
+
+    /*! the TileCodecs the service's displays can decode; clients
+        have to encode their tiles with one of those */
+    std::vector<int> codecs;
     
     /*! read a service info from a given hostName:port. The service
       has to already be running on that port 
@@ -41,6 +41,8 @@
 #include <ifaddrs.h>
 #endif
 #include <string>
+#include <vector>
+#include <algorithm>
 
 ////////////////////////////////////////////////////////////////////////////////
 /// Platforms supporting Socket interface
@@ -60,6 +62,8 @@ typedef int socklen_t;
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h> 
+#include <sys/uio.h>
+#include <limits.h>
 #define SOCKET int
 #define INVALID_SOCKET -1
 #define closesocket ::close
@@ -293,6 +297,43 @@ namespace dw2 {
 #endif
     }
 
+    void writev(socket_t hsock_i, const void *const *data, const size_t *bytes,
+                size_t count)
+    {
+#ifdef _WIN32
+      for (size_t i=0;i<count;i++)
+        write(hsock_i,data[i],bytes[i]);
+#else
+      buffered_socket_t* hsock = (buffered_socket_t*) hsock_i;
+      // whatever got written before has to go out first
+      flush(hsock_i);
+      std::vector<iovec> pieces(count);
+      for (size_t i=0;i<count;i++) {
+        pieces[i].iov_base = (void*)data[i];
+        pieces[i].iov_len  = bytes[i];
+      }
+      iovec *next = pieces.data();
+      iovec *end  = pieces.data()+count;
+      while (next != end) {
+        msghdr message = {};
+        message.msg_iov    = next;
+        message.msg_iovlen = std::min(size_t(end-next),size_t(IOV_MAX));
+        // (sendmsg rather than writev, for the MSG_NOSIGNAL)
+        ssize_t n = ::sendmsg(hsock->fd,&message,MSG_NOSIGNAL);
+        if (n < 0) THROW_RUNTIME_ERROR("error writing to socket");
+        // skip what got written; the kernel may have stopped anywhere
+        while (next != end && size_t(n) >= next->iov_len) {
+          n -= next->iov_len;
+          ++next;
+        }
+        if (next != end) {
+          next->iov_base  = (char*)next->iov_base + n;
+          next->iov_len  -= n;
+        }
+      }
+#endif
+    }
+
     void flush(socket_t hsock_i)
     {
 #if BUFFERING
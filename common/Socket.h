@@ -85,6 +85,12 @@ namespace dw2 {
     /*! write data to the socket */
     void write(socket_t socket, const void* data, size_t bytes);
 
+    /*! write 'count' pieces of data, 'bytes[i]' bytes at 'data[i]'
+        each, in order, with as few system calls as possible (and
+        without copying them into one buffer first) */
+    void writev(socket_t socket, const void *const *data, const size_t *bytes,
+                size_t count);
+
     /*! flushes the write buffer */
     void flush(socket_t socket);
 
@@ -37,16 +37,19 @@ namespace dw2 {
   /*! create a new socket group that connects to the given node(s)
     using the provided magic cookie */
   SocketGroup::SocketGroup(const size_t magic, const int numPeers,
-                           const std::vector<std::pair<std::string,int>> remoteURLs)
-    : numRemotesExpected(remoteURLs.size())
+                           const std::vector<std::pair<std::string,int>> remoteURLs,
+                           Packer::SP packer)
+    : numRemotesExpected(remoteURLs.size()),
+      packer(packer)
   {
-    outbox = std::make_shared<Mailbox>();
     for (auto &url : remoteURLs) {
       Remote::SP remote = std::make_shared<Remote>();
       remote->socket = sock::connect(url.first.c_str(),url.second);
-      // for the clients, each remote gets their own mailbox
-      remote->inbox  = std::make_shared<Mailbox>();
-      //remote->outbox = std::make_shared<Mailbox>();
+      // for the clients, each remote gets their own mailbox; those
+      // only ever see the handshake and frame tokens, so they can be
+      // small
+      remote->inbox  = std::make_shared<Mailbox>(256);
+      remote->outbox = std::make_shared<Mailbox>();
       // PING; 
       PRINT(magic); PRINT(numPeers);
       write(remote->socket,(size_t)magic);
@@ -54,25 +57,85 @@ namespace dw2 {
       sock::flush(remote->socket);
       remotes.push_back(remote);
     }
-    sendThread = std::thread([&](){sendThreadFct();});
-    recvThread = std::thread([&](){recvThreadFct();});
+    startThreads();
     std::cout << "#dw.src: all remotes connected" << "\n";
   }
 
-  void SocketGroup::sendThreadFct()
+  void SocketGroup::startThreads()
   {
+    for (auto &remote : remotes)
+      remote->sendThread = std::thread([this,remote](){sendThreadFct(remote);});
+    recvThread = std::thread([this](){recvThreadFct();});
+  }
+
+  /*! writer for one remote: drains that remote's outbox into its
+      socket */
+  void SocketGroup::sendThreadFct(Remote::SP remote)
+  {
+    assert(remote);
+    assert(remote->outbox);
+    /*! a message we already took out of the outbox, but which could
+        not go with the ones before it */
+    Mailbox::Message::SP leftOver;
+    std::vector<Mailbox::Message::SP> pending;
+    /*! what goes out in one write: the size prefix, then the message
+        (or the pieces of what the messages got packed into) */
+    std::vector<uint8_t>      framing;
+    std::vector<const void *> pieces;
+    std::vector<size_t>       pieceSizes;
     while (1) {
-      //assert(remote);
-      //assert(remote->outbox);
-      Mailbox::Message::SP message = outbox->get();
-      int sizeData = message->size();
-      for (const auto &to : message->toRank) {
-        // std::cout << "sending msg of size " << sizeData << ", to rank "
-          // << to << "\n" << std::flush;
-        write(remotes[to]->socket,&sizeData,sizeof(sizeData));
-        write(remotes[to]->socket,message->data(),sizeData);
-        sock::flush(remotes[to]->socket);
-        // std::cout << "wrote message to socket ..." << "\n";
+      Mailbox::Message::SP message = leftOver ? leftOver : remote->outbox->get();
+      leftOver = nullptr;
+      int numMessages = 1;
+
+      if (packer) {
+        // see what else is (or, within maxDelay, becomes) available
+        // for the same remote, and pack it all into one
+        pending.clear();
+        pending.push_back(message);
+        size_t numBytes = message->size();
+        const double deadline = getCurrentTime() + packer->maxDelay;
+        while (numBytes < packer->maxBytes) {
+          Mailbox::Message::SP next;
+          if (!remote->outbox->tryGet(next)) {
+            if (getCurrentTime() >= deadline) break;
+            std::this_thread::yield();
+            continue;
+          }
+          if (!packer->canPack(*message,*next)) {
+            leftOver = next;
+            break;
+          }
+          pending.push_back(next);
+          numBytes += next->size();
+        }
+        numMessages = (int)pending.size();
+      }
+
+      int sizeData = 0;
+      pieces.assign(1,&sizeData);
+      pieceSizes.assign(1,sizeof(sizeData));
+      if (numMessages > 1)
+        packer->pack(pending,framing,pieces,pieceSizes);
+      else {
+        pieces.push_back(message->data());
+        pieceSizes.push_back(message->size());
+      }
+      for (size_t i=1;i<pieceSizes.size();i++)
+        sizeData += (int)pieceSizes[i];
+      
+      const double t0 = getCurrentTime();
+      sock::writev(remote->socket,pieces.data(),pieceSizes.data(),pieces.size());
+      sock::flush(remote->socket);
+      remote->usecsWriting += uint64_t(1e6*(getCurrentTime()-t0));
+      remote->bytesWritten += sizeof(sizeData)+sizeData;
+      // (only now that they are written may the messages go)
+      pending.clear();
+      if ((remote->numPending -= numMessages) == 0) {
+        // (lock, so a waiter can not miss this between checking
+        // numPending and going to sleep)
+        { std::lock_guard<std::mutex> lock(remote->idleMutex); }
+        remote->becameIdle.notify_all();
       }
     }
   }
@@ -146,14 +209,13 @@ namespace dw2 {
     std::cout << "#dw2.server listening for clients on "
 		<< getHostName() << ":" << port << "\n";
     this->portWeAreListeningOn = port;
-    outbox = std::make_shared<Mailbox>();
     
     accepterThread = std::thread([this,listener,myMagic,inbox](){
         while (1) {
           Remote::SP remote = std::make_shared<Remote>();
           remote->socket = sock::listen(listener);
           remote->inbox  = inbox;
-          //remote->outbox = std::make_shared<Mailbox>();
+          remote->outbox = std::make_shared<Mailbox>();
           
           size_t remoteMagic;
           read(remote->socket,remoteMagic);
@@ -177,8 +239,7 @@ namespace dw2 {
             break;
           }
         }
-        sendThread = std::thread([&](){sendThreadFct();});
-        recvThread = std::thread([&](){recvThreadFct();});
+        startThreads();
       });
   }
 
@@ -198,17 +259,18 @@ namespace dw2 {
   /*! send given message to given remote rank */
   void SocketGroup::sendTo(std::vector<int> remoteRanks, Mailbox::Message::SP message)
   {
-    // _probably_ don't need this lock here - remotes[] only changes
-    // only during constructor (for outgoring) respectively before
-    // 'waritForRemotesToConnect()' (for incoming), and sendTo sohld
-    // never get called before the respectiv eone of those is complete
-    // .... but just in case*/
-    std::lock_guard<std::mutex> lock(mutex);
+    // no lock here: remotes[] only changes during the constructor
+    // (for outgoing) respectively before 'waitForRemotesToConnect()'
+    // (for incoming), and sendTo should never get called before the
+    // respective one of those is complete. more importantly, a put()
+    // into a full outbox of one slow remote must not hold up the
+    // callers that are sending to other remotes.
     assert(remotes.size() == numRemotesExpected);
-    message->toRank = remoteRanks;
-    //assert(remotes[remoteRank]->outbox);
-    //remotes[remoteRank]->outbox->put(message);
-    outbox->put(message);
+    for (auto rank : remoteRanks) {
+      assert(remotes[rank]->outbox);
+      remotes[rank]->numPending++;
+      remotes[rank]->outbox->put(message);
+    }
   }
   
 } // ::dw2
@@ -22,6 +22,9 @@
 // std
 #include <vector>
 #include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 namespace dw2 {
 
@@ -31,18 +34,86 @@ namespace dw2 {
 
     struct Remote {
       typedef std::shared_ptr<Remote> SP;
-      //Mailbox::SP    outbox;
+      /*! messages waiting to go out to this remote; every remote
+          has its own queue and its own writer thread, so a slow link
+          only ever stalls itself. a message that goes to several
+          remotes sits in each of their outboxes, but is shared, not
+          copied */
+      Mailbox::SP    outbox;
       Mailbox::SP    inbox;
       sock::socket_t socket;
+      std::thread    sendThread;
+
+      /*! bytes written to this remote so far, and the time (in
+          microseconds) the send thread spent in those writes. Once
+          the socket buffer is full a write only returns as fast as
+          the link drains it, so the ratio of the two approaches the
+          link's bandwidth as soon as the link is what holds us up */
+      std::atomic<uint64_t> bytesWritten  { 0 };
+      std::atomic<uint64_t> usecsWriting  { 0 };
+      /*! messages put into the outbox, but not yet written */
+      std::atomic<int>      numPending    { 0 };
+
+      /*! whether there is nothing waiting to go out to this remote
+          right now, ie, whether anything we send now gets sent right
+          away, without delaying anything else */
+      bool isIdle() const { return numPending == 0; }
+
+      /*! wait until this remote is idle (see isIdle()) */
+      void waitUntilIdle()
+      {
+        std::unique_lock<std::mutex> lock(idleMutex);
+        becameIdle.wait(lock,[this]{ return isIdle(); });
+      }
+
+      /*! the send thread signals this whenever numPending drops to
+          zero */
+      std::mutex              idleMutex;
+      std::condition_variable becameIdle;
+    };
+    std::thread    recvThread;
+
+    /*! optional policy for packing several messages that are queued
+        up for the same remote into one, so the send threads need one
+        size prefix, write and flush for all of them. The packed
+        message never gets assembled in memory: the send thread
+        writes its pieces - the packer's own bytes, and the original
+        messages - with one gathering write */
+    struct Packer {
+      typedef std::shared_ptr<Packer> SP;
+
+      virtual ~Packer() {}
+      
+      /*! whether 'next' may go into the same packed message as
+          'first' */
+      virtual bool canPack(const Mailbox::Message &first,
+                           const Mailbox::Message &next) = 0;
+      
+      /*! append the pieces that the given messages (at least two)
+          packed into one consist of, in order, to 'pieces' (and
+          their sizes to 'pieceSizes'); bytes of the packer's own go
+          into 'framing', everything else has to refer to the
+          messages' data. Both stay valid until the next call */
+      virtual void pack(const std::vector<Mailbox::Message::SP> &messages,
+                        std::vector<uint8_t>     &framing,
+                        std::vector<const void *> &pieces,
+                        std::vector<size_t>      &pieceSizes) = 0;
+      
+      /*! we stop adding messages once we have this many bytes */
+      size_t maxBytes   { 1<<20 };
+      /*! how long (in seconds) a send thread may wait for more
+          messages to arrive before it sends what it has; 0 means
+          only pack what is already queued up, which adds no latency
+          at all but still packs a lot once a link backs up */
+      double maxDelay   { 0. };
     };
-	std::thread    sendThread;
-	std::thread    recvThread;
-	Mailbox::SP    outbox;
 
     /*! create a new socket group that connects to the given node(s)
-        using the provided magic cookie */
+        using the provided magic cookie; if a packer is given, the
+        send threads use it to pack messages that queue up */
     SocketGroup(const size_t magic, const int numPeers,
-                const std::vector<std::pair<std::string,int>> remotes);
+                const std::vector<std::pair<std::string,int>> remotes,
+                Packer::SP packer = nullptr);
 
     /*! create a new listening socket group that will accept only
         incoming connections with the given magic cookie */
@@ -55,6 +126,7 @@ namespace dw2 {
     /*! broadcast message to all remotes */
     void broadcast(Mailbox::Message::SP message);
 
+
     // /*! get a message (from _any_ rank); blocks until one is available */
     // Mailbox::Message::SP get() { return inbox->get(); }
 
@@ -66,7 +138,9 @@ namespace dw2 {
     std::vector<Remote::SP> remotes;
     
   private:
-    void sendThreadFct();
+    /*! start one writer thread per remote, plus the reader thread */
+    void startThreads();
+    void sendThreadFct(Remote::SP remote);
     void recvThreadFct();
 
     /*! mutex for initial sync in waitForRemotesToConnect() */
@@ -85,6 +159,9 @@ namespace dw2 {
     int numRemotesExpected = -1;
 
     int portWeAreListeningOn { -1 };
+
+    /*! see Packer; null if we don't pack */
+    Packer::SP packer;
   };
   
 }
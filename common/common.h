@@ -79,6 +79,23 @@ namespace dw2 {
     }
   }
   
+  /*! allocator that does _not_ value-initialize elements on
+      resize(); for message and pixel buffers that always get
+      overwritten in full the zero-fill std::vector would otherwise do
+      is just wasted memory bandwidth */
+  template<typename T>
+  struct NoInitAllocator : public std::allocator<T> {
+    template<typename U> struct rebind { typedef NoInitAllocator<U> other; };
+    
+    NoInitAllocator() = default;
+    template<typename U> NoInitAllocator(const NoInitAllocator<U> &) {}
+    
+    template<typename U>
+    void construct(U *ptr) { ::new((void*)ptr) U; }
+    template<typename U, typename... Args>
+    void construct(U *ptr, Args&&... args) { ::new((void*)ptr) U(std::forward<Args>(args)...); }
+  };
+  
   /*! added pretty-print function for large numbers, printing 10000000 as "10M" instead */
   inline std::string prettyDouble(const double val) {
     const double absVal = abs(val);
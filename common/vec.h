@@ -69,9 +69,25 @@ namespace dw2 {
     
     inline vec2i size() const { return upper - lower; }
     
+    inline bool contains(const box2i &other) const
+    {
+      return
+        lower.x <= other.lower.x && lower.y <= other.lower.y &&
+        upper.x >= other.upper.x && upper.y >= other.upper.y;
+    }
+    
     vec2i lower, upper;
   };
 
+  inline vec2i min(const vec2i &a, const vec2i &b)
+  { return vec2i{ std::min(a.x,b.x), std::min(a.y,b.y) }; }
+  inline vec2i max(const vec2i &a, const vec2i &b)
+  { return vec2i{ std::max(a.x,b.x), std::max(a.y,b.y) }; }
+
+  /*! intersection of two boxes; only meaningful if they overlap */
+  inline box2i intersectionOf(const box2i &a, const box2i &b)
+  { return box2i(max(a.lower,b.lower),min(a.upper,b.upper)); }
+
   inline std::ostream &operator<<(std::ostream &o, const vec2i &v)
   { o << "(" << v.x << "," << v.y << ")"; return o; }
 
@@ -32,6 +32,31 @@ namespace dw2 {
     dispatchThread = std::thread([this](){this->dispatchThreadFunction();});
   }
   
+  /*! a container of tiles usually has tiles for several ranks: give
+      each rank a container with only those tiles it needs */
+  void Dispatcher::dispatchContainer(Mailbox::Message::SP container)
+  {
+    const std::vector<std::pair<size_t,size_t>> tiles = packedTiles(*container);
+    for (size_t remoteID=0;remoteID<regionOfRank.size();remoteID++) {
+      std::vector<const uint8_t *> tilesForRank;
+      std::vector<size_t>          sizesForRank;
+      for (auto &tile : tiles) {
+        const uint8_t *data = container->data()+tile.first;
+        if (((const TileMessageDataHeader *)data)->nativeRegion()
+            .overlaps(regionOfRank[remoteID])) {
+          tilesForRank.push_back(data);
+          sizesForRank.push_back(tile.second);
+        }
+      }
+      if (tilesForRank.empty())
+        continue;
+      Mailbox::Message::SP forRank
+        = packTiles(tilesForRank.data(),sizesForRank.data(),tilesForRank.size());
+      MPI_CALL(Send(forRank->data(),forRank->size(),
+                    MPI_BYTE,(int)remoteID,0,displayComm.comm));
+    }
+  }
+  
   /* performs the actual work - take tiles off the inbox, and dispatch
      them to whoeve rneeds them */
   void Dispatcher::dispatchThreadFunction()
@@ -43,8 +68,12 @@ namespace dw2 {
       while (1) {
         Mailbox::Message::SP message = inbox->get();
         const TileMessageDataHeader *header = (const TileMessageDataHeader *)message->data();
-        const box2i region = header->region;
 	//std::cout << "Head node dispatcher ... " << std::endl;
+        if (header->flags & TileMessageDataHeader::CONTAINER) {
+          dispatchContainer(message);
+          continue;
+        }
+        const box2i region = header->nativeRegion();
         for (int remoteID=0;remoteID<regionOfRank.size();remoteID++) {
           if (region.overlaps(regionOfRank[remoteID]))
             // displayComm->forwardTo(remoteID,message);
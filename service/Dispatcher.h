@@ -55,6 +55,9 @@ namespace dw2 {
     /* performs the actual work - take tiles off the inbox, and
        dispatch them to whoeve rneeds them */
     void dispatchThreadFunction();
+
+    /*! split a container of tiles into one container per rank */
+    void dispatchContainer(Mailbox::Message::SP container);
     
     /*! the thread we use to perform the dispatching */
     std::thread              dispatchThread;
@@ -16,28 +16,244 @@
 
 #include "FrameAssembler.h"
 #include "../common/CompressedTile.h"
+#include "../common/Blit.h"
+// std
+#include <atomic>
+#include <chrono>
+#include <bitset>
+#if defined(__SSE2__) || defined(_M_X64)
+# include <emmintrin.h>
+# define DW2_SSE2 1
+#endif
 
 namespace dw2 {
 
+  CoverageMap::CoverageMap(const vec2i &size, int numEyes)
+    : size(size),
+      numBlocks(divRoundUp(size,vec2i(blockSize))),
+      pixelsWritten(numEyes*numBlocks.product()*wordsPerBlock),
+      numPixelsWritten(numEyes*numBlocks.product())
+  {}
+
+  /*! account for given region of given eye having been written */
+  void CoverageMap::add(const box2i &region, int eye)
+  {
+    if (region.lower.x >= region.upper.x || region.lower.y >= region.upper.y)
+      return;
+    std::atomic<uint64_t> *bits   = pixelsWritten.data() + eye*numBlocks.product()*wordsPerBlock;
+    std::atomic<uint32_t> *blocks = numPixelsWritten.data() + eye*numBlocks.product();
+    for (int by=region.lower.y/blockSize;by<=(region.upper.y-1)/blockSize;by++)
+      for (int bx=region.lower.x/blockSize;bx<=(region.upper.x-1)/blockSize;bx++) {
+        const box2i    block = blockRegion(bx,by);
+        const uint32_t area  = block.size().product();
+        // the part of the region in this block, relative to the block
+        const box2i    written = intersectionOf(block,region);
+        const box2i    local(written.lower-block.lower,written.upper-block.lower);
+        const uint64_t rowMask
+          = ((uint64_t(1) << local.size().x) - 1) << local.lower.x;
+        std::atomic<uint64_t> *words = bits + (bx+numBlocks.x*by)*wordsPerBlock;
+        uint32_t numNew = 0;
+        for (int w=local.lower.y/rowsPerWord;w<=(local.upper.y-1)/rowsPerWord;w++) {
+          uint64_t mask = 0;
+          for (int y=std::max(local.lower.y,w*rowsPerWord);
+               y<std::min(local.upper.y,(w+1)*rowsPerWord);y++)
+            mask |= rowMask << ((y-w*rowsPerWord)*blockSize);
+          // only count the pixels nobody wrote before
+          const uint64_t before = words[w].fetch_or(mask);
+          numNew += (uint32_t)std::bitset<64>(mask & ~before).count();
+        }
+        if (!numNew) continue;
+        const uint32_t numBefore = blocks[bx+numBlocks.x*by].fetch_add(numNew);
+        if (numBefore+numNew == area)
+          numBlocksCovered++;
+      }
+  }
+
+  /*! the regions of given eye that are not covered yet */
+  std::vector<box2i> CoverageMap::missingRegions(int eye) const
+  {
+    const std::atomic<uint32_t> *blocks = numPixelsWritten.data() + eye*numBlocks.product();
+    std::vector<box2i> regions;
+    for (int by=0;by<numBlocks.y;by++)
+      for (int bx=0;bx<numBlocks.x;) {
+        if (blocks[bx+numBlocks.x*by] == (uint32_t)blockRegion(bx,by).size().product()) {
+          bx++;
+          continue;
+        }
+        const int begin = bx;
+        while (bx < numBlocks.x
+               && blocks[bx+numBlocks.x*by] < (uint32_t)blockRegion(bx,by).size().product())
+          bx++;
+        regions.push_back(box2i(blockRegion(begin,by).lower,blockRegion(bx-1,by).upper));
+      }
+    return regions;
+  }
+
+  /*! start over, for a new frame */
+  void CoverageMap::clear()
+  {
+    for (auto &word : pixelsWritten)
+      word = 0;
+    for (auto &block : numPixelsWritten)
+      block = 0;
+    numBlocksCovered = 0;
+  }
+  
   FrameToBe::MarkCompletionResult FrameToBe::markPixelsCompleted(size_t numNewPixels)
   {
-    std::lock_guard<std::mutex> lock(mutex);
-    numPixelsCompleted += numNewPixels;
-   // std::cout << "#assembler: assembled " << numNewPixels << " pixels, now have " << numPixelsCompleted << "/" << numPixelsExpected << "\n";
-    return (numPixelsCompleted == numPixelsExpected)
+    const size_t numNow = (numPixelsCompleted += numNewPixels);
+   // std::cout << "#assembler: assembled " << numNewPixels << " pixels, now have " << numNow << "/" << numPixelsExpected << "\n";
+    if (!coverage && numNow > numPixelsExpected && numNow-numNewPixels < numPixelsExpected)
+      // some pixels got written twice (or by overlapping tiles), so
+      // we can't tell when we have them all - rather than handing on
+      // a frame that may still miss some, say so
+      std::cout << "#dw2.assembler: frame " << frameID << " got "
+                << prettyNumber(numNow) << " pixels, expected "
+                << prettyNumber(numPixelsExpected)
+                << " - overlapping or duplicate tiles? (see --coverage-map)" << "\n";
+    const bool allThere
+      = coverage
+      ? coverage->complete()
+      : numNow == numPixelsExpected;
+    return (allThere && !finished.exchange(true))
       ? FRAME_NOW_COMPLETED
       : FRAME_NOT_YET_DONE;
   }
 
+  /*! start writing tiles into this frame, unless it got closed */
+  bool FrameToBe::beginWriting()
+  {
+    std::lock_guard<std::mutex> lock(writersMutex);
+    if (closed)
+      return false;
+    numWriters++;
+    return true;
+  }
+
+  /*! done writing what beginWriting() let us write */
+  void FrameToBe::endWriting()
+  {
+    std::lock_guard<std::mutex> lock(writersMutex);
+    if (--numWriters == 0)
+      writersDone.notify_all();
+  }
+
+  /*! let nobody start writing into this frame any more, and wait for
+    whoever still does */
+  void FrameToBe::close()
+  {
+    std::unique_lock<std::mutex> lock(writersMutex);
+    closed = true;
+    while (numWriters > 0)
+      writersDone.wait(lock);
+  }
+
+  FramePool::FramePool(int numFrames, const vec2i &size, bool stereo, bool withCoverageMaps)
+  {
+    for (int i=0;i<numFrames;i++) {
+      frames.push_back(std::unique_ptr<FrameToBe>(new FrameToBe(0,size,stereo,withCoverageMaps)));
+      freeFrames.push_back(frames.back().get());
+    }
+  }
+
+  /*! get a free frame buffer to assemble given frame in, waiting for
+    one to come back if all of them are in use */
+  FrameToBe::SP FramePool::get(size_t frameID)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (freeFrames.empty())
+      frameReleased.wait(lock);
+    FrameToBe *frame = freeFrames.back();
+    freeFrames.pop_back();
+
+    frame->frameID            = frameID;
+    frame->numPixelsCompleted = 0;
+    frame->completed          = false;
+    frame->finished           = false;
+    frame->firstTileTime      = 0.;
+    frame->numWriters         = 0;
+    frame->closed             = false;
+    if (frame->coverage)
+      frame->coverage->clear();
+    // the deleter keeps the pool alive until the last frame is back
+    FramePool::SP self = shared_from_this();
+    return FrameToBe::SP(frame,[self](FrameToBe *frame){ self->release(frame); });
+  }
+
+  void FramePool::release(FrameToBe *frame)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    freeFrames.push_back(frame);
+    frameReleased.notify_one();
+  }
+  
+  /*! write the pixels for native x coordinates [x0,x1) of a tile row
+      rendered at 1/scale resolution, by replicating every source
+      pixel 'scale' times (nearest-neighbor upscaling); 'in' is the
+      source pixel that x0 falls into */
+  static void upsampleRow(uint32_t *out, const uint32_t *in,
+                          int x0, int x1, int scale)
+  {
+    if (scale == 1) {
+      memcpy(out,in,(x1-x0)*sizeof(uint32_t));
+      return;
+    }
+    
+    // rest of the source pixel that x0 falls into, if x0 is not
+    // aligned to 'scale'
+    const int lead = std::min(x1-x0,(scale - x0 % scale) % scale);
+    if (lead) {
+      std::fill_n(out,lead,*in++);
+      out += lead;
+      x0  += lead;
+    }
+
+    const int numFull = (x1-x0) / scale;
+    int i = 0;
+#if DW2_SSE2
+    if (scale == 2)
+      for (;i+4<=numFull;i+=4,out+=8) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(in+i));
+        _mm_storeu_si128((__m128i*)(out+0),_mm_unpacklo_epi32(v,v));
+        _mm_storeu_si128((__m128i*)(out+4),_mm_unpackhi_epi32(v,v));
+      }
+    else if (scale == 4)
+      for (;i+4<=numFull;i+=4,out+=16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(in+i));
+        _mm_storeu_si128((__m128i*)(out+ 0),_mm_shuffle_epi32(v,0x00));
+        _mm_storeu_si128((__m128i*)(out+ 4),_mm_shuffle_epi32(v,0x55));
+        _mm_storeu_si128((__m128i*)(out+ 8),_mm_shuffle_epi32(v,0xaa));
+        _mm_storeu_si128((__m128i*)(out+12),_mm_shuffle_epi32(v,0xff));
+      }
+#endif
+    for (;i<numFull;i++,out+=scale)
+      std::fill_n(out,scale,in[i]);
+
+    // and the source pixel that x1 cuts through, if any
+    const int tail = (x1-x0) - numFull*scale;
+    if (tail)
+      std::fill_n(out,tail,in[numFull]);
+  }
+  
   /*! construct a new assembler, and start the assembly process */
   FrameAssembler::FrameAssembler(TimeStampedMailbox::SP inbox,
                                  const box2i &myRegion,
                                  bool stereo,
-                                 int numThreads)
-    : assemblerThreads(numThreads),
+                                 int numThreads,
+                                 const FrameCompletionPolicy &policy)
+    : // the ones we assemble, as many completed ones the display has
+      // not collected yet, plus the one on screen and the one the
+      // window displayed last
+      framePool(std::make_shared<FramePool>(2*inbox->numFramesInFlight+2,
+                                            myRegion.size(),stereo,
+                                            policy.useCoverageMap || policy.deadline > 0.)),
+      assemblerThreads(numThreads),
       inbox(inbox),
       myRegion(myRegion),
-      stereo(stereo)
+      stereo(stereo),
+      policy(policy),
+      references(std::make_shared<ReferenceTiles>()),
+      decoders([this](){ return TileDecoder::create(references); })
   {
     {
       std::lock_guard<std::mutex> lock(mutex);
@@ -46,13 +262,13 @@ namespace dw2 {
       for (auto &thread : assemblerThreads) 
         thread = std::thread([this]() { this->assemblerThreadFunction(); });
     }
-    startOnNewFrame(0);
+    startOnNewFrames();
   }
 
   
   void FrameAssembler::assemblerThreadFunction()
   {
-    TileDecoder::SP decoder = TileDecoder::create();
+    TileDecoder::SP decoder = TileDecoder::create(references);
     
     while (1) {
       // ------------------------------------------------------------------
@@ -62,99 +278,539 @@ namespace dw2 {
       // following to be correct, because of the following argument:
       //
       // a) if we do get a message from get(), then this must be from
-      // the *current* frame (else the mailbox wouldn't have let it
-      // through)
+      // one of the frames in flight (else the mailbox wouldn't have
+      // let it through)
       //
       // b) we also know the frame cannot be finished yet, else we'd
       // not have gotten a tile for it.
       //
-      // c) we therefore know that 'currentFrame' is valid, because it
-      // was created before the the message was ever let through to
-      // us, and because it won't be overwritten until it has been
-      // completed.
+      // c) we therefore know that its frame is in 'frames', because
+      // it was added before the message was ever let through to us,
+      // and because it won't be removed until it has been
+      // completed. (The only exception are tiles without any pixels
+      // for us; see TimeStampedMailbox::locked_put.)
       // ------------------------------------------------------------------
       Mailbox::Message::SP message = inbox->get();
 
-      FrameToBe::SP currentFrame = getCurrentFrame();
+      const TileMessageDataHeader *header
+        = (const TileMessageDataHeader *)message->data();
+      if (header->flags & TileMessageDataHeader::REFINEMENT) {
+        // not part of any frame, so nothing to count
+        if (header->flags & TileMessageDataHeader::CONTAINER) {
+          const std::vector<std::pair<size_t,size_t>> tiles = packedTiles(*message);
+          parallel_for(tiles.size(),[&](size_t tileID){
+              applyRefinement(*decoders.local(),message,
+                              tiles[tileID].first,tiles[tileID].second);
+            });
+        } else
+          applyRefinement(*decoder,message,0,message->size());
+        continue;
+      }
       
-      PlainTile plainTile;
-      decoder->decode(plainTile,message); 
-    
-      const box2i globalRegion  = plainTile.region;
+      FrameToBe::SP currentFrame = getFrame(header->frameID);
+      if (!currentFrame || !currentFrame->beginWriting())
+        // (handed on - or, having missed its deadline, about to be -
+        // without this tile)
+        continue;
+
       size_t numWritten = 0;
-      const uint32_t *tilePixel = plainTile.pixels.data();
-      uint32_t *localPixel
-        = plainTile.eye==0
-        ? currentFrame->leftEyePixels.data()
-        : currentFrame->rightEyePixels.data();
+      if (header->flags & TileMessageDataHeader::CONTAINER) {
+        // lots of (usually small) tiles, all of the same frame -
+        // assemble them in parallel, and count them all at once
+        const std::vector<std::pair<size_t,size_t>> tiles = packedTiles(*message);
+        std::atomic<size_t> numWrittenInContainer(0);
+        parallel_for(tiles.size(),[&](size_t tileID){
+            numWrittenInContainer
+              += assembleTile(currentFrame,*decoders.local(),message,
+                              tiles[tileID].first,tiles[tileID].second);
+          });
+        numWritten = numWrittenInContainer;
+      } else
+        numWritten = assembleTile(currentFrame,*decoder,message,0,message->size());
+      currentFrame->endWriting();
       
-      for (int iy=globalRegion.lower.y;iy<globalRegion.upper.y;iy++) {
-              
-        if (iy  < myRegion.lower.y) { continue; }
-        if (iy >= myRegion.upper.y) { continue; }
-              
-        for (int ix=globalRegion.lower.x;ix<globalRegion.upper.x;ix++) {
-          if (ix  < myRegion.lower.x) { continue; }
-          if (ix >= myRegion.upper.x) { continue; }
-                
-          const vec2i globalCoord(ix,iy);
-          const vec2i tileCoord = globalCoord-plainTile.region.lower;
-          const vec2i localCoord = globalCoord-myRegion.lower;
-          const int localPitch = myRegion.size().x;
-          const int tilePitch  = plainTile.region.size().x;
-          const int tileOfs = tileCoord.x + tilePitch * tileCoord.y;
-          const int localOfs = localCoord.x + localPitch * localCoord.y;
-          localPixel[localOfs] = tilePixel[tileOfs];
-          ++numWritten;
-        }
-      }
-      assert(numWritten > 0);
-      if (currentFrame->markPixelsCompleted(numWritten) == FrameToBe::FRAME_NOW_COMPLETED) 
+      // (tiles that wait for the frame before get counted once they
+      // are written)
+      if (numWritten > 0 &&
+          currentFrame->markPixelsCompleted(numWritten) == FrameToBe::FRAME_NOW_COMPLETED) 
         finishFrame(currentFrame);
     }
   }
 
 
+  /*! decode the tile message that is 'size' bytes at 'offset' in
+    given message, and write it into given frame */
+  size_t FrameAssembler::assembleTile(FrameToBe::SP frame,
+                                      TileDecoder &decoder,
+                                      Mailbox::Message::SP message,
+                                      size_t offset, size_t size)
+  {
+    const TileMessageDataHeader *header
+      = (const TileMessageDataHeader *)(message->data()+offset);
+    if (policy.deadline > 0.) {
+      // the frame's deadline starts with its first tile
+      double noTileYet = 0.;
+      frame->firstTileTime.compare_exchange_strong(noTileYet,getCurrentTime());
+    }
+    if (needsFrameBefore(header) && waitForFrameBefore(frame,message,offset,size))
+      return 0;
+
+    const box2i region = header->nativeRegion();
+    size_t numWritten = 0;
+    try {
+      numWritten = decodeAndWriteTile(frame,decoder,message,offset,size);
+      if (!(header->flags & TileMessageDataHeader::UNCHANGED))
+        // (a temporal tile decoding fine means our decoder had the
+        // very reference the client encoded it against)
+        markInSync(region,header->eye);
+    } catch (const MissingReferenceTile &) {
+      // with a deadline, its reference most likely was in a frame
+      // that got handed on without it. Either way: keep what the
+      // frame before had, same as for a tile we don't get at all,
+      // and remember we did
+      if (policy.deadline <= 0.)
+        std::cout << "#dw2.assembler: temporal tile of frame " << header->frameID
+                  << " refers to a reference tile we do not have,"
+                  << " keeping the pixels of the frame before" << "\n";
+      numWritten = copyFromPreviousFrame(frame,region,header->eye);
+      markOutOfSync(region,header->eye);
+    }
+
+    if (frame->coverage && numWritten) {
+      const box2i written = intersectionOf(region,myRegion);
+      frame->coverage->add(box2i(written.lower-myRegion.lower,
+                                 written.upper-myRegion.lower),header->eye);
+    }
+    return numWritten;
+  }
+
+  /*! decode the tile message that is 'size' bytes at 'offset' in
+    given message, and write it into given frame, without any
+    bookkeeping */
+  size_t FrameAssembler::decodeAndWriteTile(FrameToBe::SP frame,
+                                            TileDecoder &decoder,
+                                            Mailbox::Message::SP message,
+                                            size_t offset, size_t size)
+  {
+    const TileMessageDataHeader *header
+      = (const TileMessageDataHeader *)(message->data()+offset);
+    if (header->flags & TileMessageDataHeader::UNCHANGED) {
+      // the client does the same for the tile it did not send
+      references->touch(header->region,header->eye,header->scale,header->frameID);
+      return copyFromPreviousFrame(frame,header->nativeRegion(),header->eye);
+    }
+    
+    {
+      // from now on, refinements of whatever this region showed
+      // before are stale
+      // (tiles of later frames may well have come in before)
+      std::lock_guard<std::mutex> lock(refinementMutex);
+      auto it = lastChanged.insert({{{ header->region.lower.x, header->region.lower.y,
+                                       header->region.upper.x, header->region.upper.y,
+                                       header->eye, header->scale }},
+                                    header->frameID }).first;
+      it->second = std::max(it->second,header->frameID);
+    }
+    
+    if (header->scale == 1 && myRegion.contains(header->region)) {
+      // the tile's pixels go to the frame buffer as they are - let
+      // the decoder write them there right away
+      PlainTile target;
+      target.region = header->region;
+      target.eye    = header->eye;
+      target.pitch  = myRegion.size().x;
+      target.pixels
+        = (header->eye==0
+           ? frame->leftEyePixels.data()
+           : frame->rightEyePixels.data())
+        + (header->region.lower.x-myRegion.lower.x)
+        + target.pitch * size_t(header->region.lower.y-myRegion.lower.y);
+      decoder.decode(target,message,offset,size);
+      return header->region.size().product();
+    }
+
+    // clipped, or to be upscaled: decode into scratch space, and
+    // write what falls into our region from there. The scratch
+    // tile's storage gets re-used unless somebody (eg, the
+    // reference tiles) still holds on to it
+    thread_local PlainTile scratch;
+    decoder.decode(scratch,message,offset,size);
+    return writeTile(frame,scratch);
+  }
+
+  /*! decode a refinement tile, and write it into the frame(s) that
+    still show the lossy tile it refines */
+  void FrameAssembler::applyRefinement(TileDecoder &decoder,
+                                       Mailbox::Message::SP message,
+                                       size_t offset, size_t size)
+  {
+    const TileMessageDataHeader *header
+      = (const TileMessageDataHeader *)(message->data()+offset);
+    if (isOutOfSync(header->nativeRegion(),header->eye))
+      // the display may not show the lossy tile this refines at all
+      return;
+    
+    PlainTile refinement;
+    decoder.decode(refinement,message,offset,size);
+    
+    std::lock_guard<std::mutex> lock(refinementMutex);
+    if (!tryRefine(refinement))
+      pendingRefinements.push_back(refinement);
+  }
+
+  /*! write the given refinement if the lossy tile it refines is on
+    display */
+  bool FrameAssembler::tryRefine(const PlainTile &refinement)
+  {
+    const int refinedFrameID = refinement.frameID;
+    // all frames that (may) show the lossy tile: the one we last
+    // handed on, and the ones we still assemble
+    std::vector<FrameToBe::SP> targets;
+    bool refinedFrameCompleted;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto refined = frames.find(refinedFrameID);
+      // (frames before the oldest one we have are all complete)
+      refinedFrameCompleted
+        = refined == frames.end()
+        ? refinedFrameID < (frames.empty() ? nextFrameID : frames.begin()->first)
+        : refined->second->completed;
+      if (_previousFrame && (int)_previousFrame->frameID >= refinedFrameID)
+        targets.push_back(_previousFrame);
+      for (auto it = frames.lower_bound(refinedFrameID); it != frames.end(); ++it)
+        targets.push_back(it->second);
+    }
+    auto it = lastChanged.find({{ refinement.region.lower.x, refinement.region.lower.y,
+                                  refinement.region.upper.x, refinement.region.upper.y,
+                                  refinement.eye, refinement.scale }});
+    const int lastChangedFrameID = it == lastChanged.end() ? -1 : it->second;
+    
+    if (!refinedFrameCompleted)
+      // the lossy tile may not be written yet - wait until its frame
+      // is complete
+      return lastChangedFrameID > refinedFrameID;
+    if (lastChangedFrameID != refinedFrameID)
+      // the region has changed since (or, falling into a bezel, never
+      // got written at all): drop it
+      return true;
+    
+    // later frames may already have copied the lossy pixels from
+    // the one before, or may yet do so - either way, all of them end
+    // up with the refined pixels
+    for (auto &frame : targets)
+      writeTile(frame,refinement);
+    return true;
+  }
+  
+  /*! write the given (decoded) tile into the given frame, upscaling
+    it if it was rendered at less than native resolution */
+  size_t FrameAssembler::writeTile(FrameToBe::SP frame,
+                                   const PlainTile &tile)
+  {
+    const int   scale = tile.scale;
+    const box2i nativeRegion(tile.region.lower*vec2i(scale),
+                             tile.region.upper*vec2i(scale));
+    if (!nativeRegion.overlaps(myRegion))
+      return 0;
+    const box2i globalRegion = intersectionOf(nativeRegion,myRegion);
+
+    uint32_t *localPixel
+      = tile.eye==0
+      ? frame->leftEyePixels.data()
+      : frame->rightEyePixels.data();
+    const int localPitch = myRegion.size().x;
+    const int width      = globalRegion.size().x;
+    if (scale == 1)
+      return blit(localPixel,myRegion,localPitch,tile.pixels,tile.region,tile.pitch);
+
+    for (int iy=globalRegion.lower.y;iy<globalRegion.upper.y;iy++) {
+      uint32_t *out
+        = localPixel
+        + (globalRegion.lower.x-myRegion.lower.x)
+        + localPitch * size_t(iy-myRegion.lower.y);
+      if (iy > globalRegion.lower.y && (iy/scale) == ((iy-1)/scale)) {
+        // same source row as the line before - that one's already
+        // upscaled, so just copy it
+        memcpy(out,out-localPitch,width*sizeof(uint32_t));
+        continue;
+      }
+      const uint32_t *in
+        = tile.pixels
+        + (globalRegion.lower.x/scale - tile.region.lower.x)
+        + tile.pitch * size_t(iy/scale - tile.region.lower.y);
+      upsampleRow(out,in,globalRegion.lower.x,globalRegion.upper.x,scale);
+    }
+    return globalRegion.size().product();
+  }
+  
+  /*! whether any of given region of given eye is out of sync */
+  bool FrameAssembler::isOutOfSync(const box2i &region, int eye)
+  {
+    if (numOutOfSync == 0)
+      return false;
+    std::lock_guard<std::mutex> lock(outOfSyncMutex);
+    for (auto &outOfSyncRegion : outOfSync[eye])
+      if (outOfSyncRegion.overlaps(region))
+        return true;
+    return false;
+  }
+
+  /*! account for given region of given eye no longer showing what
+    the client thinks it does */
+  void FrameAssembler::markOutOfSync(const box2i &region, int eye)
+  {
+    if (!region.overlaps(myRegion))
+      return;
+    std::lock_guard<std::mutex> lock(outOfSyncMutex);
+    outOfSync[eye].push_back(intersectionOf(region,myRegion));
+    numOutOfSync++;
+  }
+
+  /*! account for given region of given eye having gotten pixels that
+    do not depend on what it showed before */
+  void FrameAssembler::markInSync(const box2i &region, int eye)
+  {
+    if (numOutOfSync == 0)
+      return;
+    std::lock_guard<std::mutex> lock(outOfSyncMutex);
+    // cut the region out of every out-of-sync region it overlaps,
+    // keeping (up to) four bands around it
+    std::vector<box2i> stillOutOfSync;
+    for (auto &r : outOfSync[eye]) {
+      if (!r.overlaps(region)) {
+        stillOutOfSync.push_back(r);
+        continue;
+      }
+      const box2i cut = intersectionOf(r,region);
+      if (r.lower.y < cut.lower.y)
+        stillOutOfSync.push_back(box2i(r.lower,vec2i(r.upper.x,cut.lower.y)));
+      if (cut.upper.y < r.upper.y)
+        stillOutOfSync.push_back(box2i(vec2i(r.lower.x,cut.upper.y),r.upper));
+      if (r.lower.x < cut.lower.x)
+        stillOutOfSync.push_back(box2i(vec2i(r.lower.x,cut.lower.y),vec2i(cut.lower.x,cut.upper.y)));
+      if (cut.upper.x < r.upper.x)
+        stillOutOfSync.push_back(box2i(vec2i(cut.upper.x,cut.lower.y),vec2i(r.upper.x,cut.upper.y)));
+    }
+    numOutOfSync -= outOfSync[eye].size();
+    numOutOfSync += stillOutOfSync.size();
+    outOfSync[eye].swap(stillOutOfSync);
+  }
+  
+  /*! copy given region (in global coordinates) of the given eye from
+    the previous frame into 'currentFrame' */
+  size_t FrameAssembler::copyFromPreviousFrame(FrameToBe::SP currentFrame,
+                                               const box2i &globalRegion,
+                                               int eye)
+  {
+    FrameToBe::SP previousFrame;
+    {
+      // we only get here once the frame before is complete; so it's
+      // either still waiting to be handed on, or the last one that
+      // was
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = frames.find(currentFrame->frameID-1);
+      if (it != frames.end())
+        previousFrame = it->second;
+      else if (_previousFrame && _previousFrame->frameID+1 == currentFrame->frameID)
+        previousFrame = _previousFrame;
+    }
+    if (!previousFrame)
+      throw std::runtime_error("got an 'unchanged' tile, but there is no previous frame");
+    
+    if (!globalRegion.overlaps(myRegion))
+      return 0;
+    const box2i localRegion = intersectionOf(globalRegion,myRegion);
+    
+    const uint32_t *in
+      = eye==0
+      ? previousFrame->leftEyePixels.data()
+      : previousFrame->rightEyePixels.data();
+    uint32_t *out
+      = eye==0
+      ? currentFrame->leftEyePixels.data()
+      : currentFrame->rightEyePixels.data();
+    
+    const int    localPitch = myRegion.size().x;
+    const vec2i  begin      = localRegion.lower - myRegion.lower;
+    const size_t ofs        = begin.x + localPitch * size_t(begin.y);
+    return blit(out,myRegion,localPitch,in+ofs,localRegion,localPitch);
+  }
+  
+  /*! if the frame before the given one is not complete yet, park
+    the given tile in 'frame' until it is */
+  bool FrameAssembler::waitForFrameBefore(FrameToBe::SP frame,
+                                          Mailbox::Message::SP message,
+                                          size_t offset, size_t size)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    // frames we do not have (any more) are complete
+    auto it = frames.find(frame->frameID-1);
+    if (it == frames.end() || it->second->completed)
+      return false;
+    frame->waitingTiles.push_back({ message, offset, size });
+    return true;
+  }
+  
   /*! gets called by the assembler thread that wrote the last pixels
     that completed a frame */
   void FrameAssembler::finishFrame(FrameToBe::SP finishedFrame)
   {
     //std::cout << "#server(" << mpi::Comm(MPI_COMM_WORLD).rank() << "): frame completely assembled..." << "\n";
-    
-    // FrameToBe::SP finishedFrame = currentFrame;
     assert(finishedFrame);
+    // (a tile that got written twice may still be on its way in)
+    finishedFrame->close();
 
+    bool handedOn = false;
+    FrameToBe::SP nextFrame;
+    std::vector<FrameToBe::WaitingTile> waitingTiles;
     {
       std::lock_guard<std::mutex> lock(mutex);
-      finishedFrames.push_back(finishedFrame);
-      finishedFramesAvailable.notify_all();
+      finishedFrame->completed = true;
+      // hand on whatever is complete now, strictly in order
+      while (!frames.empty() && frames.begin()->second->completed) {
+        _previousFrame = frames.begin()->second;
+        finishedFrames.push_back(_previousFrame);
+        frames.erase(frames.begin());
+        handedOn = true;
+      }
+      if (handedOn)
+        finishedFramesAvailable.notify_all();
+      
+      auto next = frames.find(finishedFrame->frameID+1);
+      if (next != frames.end()) {
+        nextFrame = next->second;
+        waitingTiles.swap(nextFrame->waitingTiles);
+      }
     }
     
-    startOnNewFrame(finishedFrame->frameID+1);
+    {
+      // refinements that waited for the frame we just completed
+      std::lock_guard<std::mutex> lock(refinementMutex);
+      std::vector<PlainTile> stillPending;
+      for (auto &refinement : pendingRefinements)
+        if (!tryRefine(refinement))
+          stillPending.push_back(refinement);
+      pendingRefinements.swap(stillPending);
+    }
+    
+    if (handedOn)
+      startOnNewFrames();
+
+    if (waitingTiles.empty())
+      return;
+    
+    // the tiles of the next frame that waited for this one can go
+    // ahead now
+    if (!nextFrame->beginWriting())
+      return;
+    std::atomic<size_t> numWritten(0);
+    parallel_for(waitingTiles.size(),[&](size_t tileID){
+        const FrameToBe::WaitingTile &tile = waitingTiles[tileID];
+        numWritten += assembleTile(nextFrame,*decoders.local(),
+                                   tile.message,tile.offset,tile.size);
+      });
+    nextFrame->endWriting();
+    if (numWritten > 0 &&
+        nextFrame->markPixelsCompleted(numWritten) == FrameToBe::FRAME_NOW_COMPLETED) 
+      finishFrame(nextFrame);
   }
     
-  /*! create a new frame buffer to be, and return the old one. may
-    only get called by a thread that has acquired the mutex */
-  void FrameAssembler::startOnNewFrame(int newFrameID)
+  /*! add frames to assemble until we have as many as the inbox lets
+    through at once, and have the inbox let through the tiles for
+    them */
+  void FrameAssembler::startOnNewFrames()
   {
-   //std::cout << "#server(" << mpi::Comm(MPI_COMM_WORLD).rank() << "): starting on new frame " << newFrameID << "\n";
-    /* must HAS to be locked when this is called, so don't lcok again */
-    FrameToBe::SP newFrame = std::make_shared<FrameToBe>(newFrameID,
-                                                         myRegion.size(),
-                                                         stereo);
-    setCurrentFrame(newFrame);
-    inbox->startNewFrame(newFrameID);
+    std::lock_guard<std::mutex> startFramesLock(startFramesMutex);
+    int oldestFrameID;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      oldestFrameID = frames.empty() ? nextFrameID : frames.begin()->first;
+    }
+    //std::cout << "#server(" << mpi::Comm(MPI_COMM_WORLD).rank() << "): starting on new frame " << oldestFrameID << "\n";
+    while (nextFrameID < oldestFrameID + inbox->numFramesInFlight) {
+      // this may have to wait for the display to give a frame
+      // buffer back, so don't hold the mutex while we do
+      FrameToBe::SP newFrame = framePool->get(nextFrameID);
+      std::lock_guard<std::mutex> lock(mutex);
+      frames[nextFrameID++] = newFrame;
+    }
+    // the oldest frame's temporal tiles only ever refer to the frame
+    // just before
+    references->prune(oldestFrameID-1);
+    inbox->startNewFrame(oldestFrameID);
   }
 
-  FrameBuffer::SP FrameAssembler::collectAssembledFrame()
+  /*! hand on the given frame even though it is not complete, with
+    the regions it is missing copied from the frame before */
+  void FrameAssembler::finishIncompleteFrame(FrameToBe::SP frame)
   {
-    std::unique_lock<std::mutex> lock(mutex);
-    while (finishedFrames.empty())
-      finishedFramesAvailable.wait(lock);
+    if (frame->finished.exchange(true))
+      // got completed after all, and handed on by whoever did
+      return;
+    // tiles that are being written right now still make it; any
+    // others are too late
+    frame->close();
 
-    auto ret = finishedFrames.front();
-    finishedFrames.pop_front();
-    return ret;
+    size_t numMissing = 0, numMissingRegions = 0;
+    for (int eye=0;eye<(stereo?2:1);eye++)
+      for (auto &region : frame->coverage->missingRegions(eye)) {
+        numMissing += region.size().product();
+        numMissingRegions++;
+        const box2i globalRegion(region.lower+myRegion.lower,region.upper+myRegion.lower);
+        // (the very first frame has nothing before it to take the
+        // pixels from - that one just shows what its buffer had)
+        if (frame->frameID > 0)
+          copyFromPreviousFrame(frame,globalRegion,eye);
+        markOutOfSync(globalRegion,eye);
+      }
+    std::cout << "#dw2.assembler: frame " << frame->frameID
+              << " missed its deadline, handing it on with "
+              << prettyNumber(numMissing) << " pixels (in " << numMissingRegions
+              << " regions) kept from the frame before" << "\n";
+    finishFrame(frame);
+  }
+
+  FrameBuffer::SP FrameAssembler::collectAssembledFrame()
+  {
+    while (1) {
+      FrameToBe::SP overdueFrame;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (finishedFrames.empty()) {
+          if (policy.deadline <= 0.) {
+            finishedFramesAvailable.wait(lock);
+            continue;
+          }
+          if (frames.empty()) {
+            // in between handing on one and adding the next ones
+            finishedFramesAvailable.wait_for(lock,std::chrono::duration<double>(policy.deadline));
+            continue;
+          }
+          // the oldest frame is the one that holds up all others
+          const FrameToBe::SP oldest = frames.begin()->second;
+          const double firstTileTime = oldest->firstTileTime;
+          const double now = getCurrentTime();
+          if (firstTileTime > 0. && now >= firstTileTime+policy.deadline) {
+            overdueFrame = oldest;
+            break;
+          }
+          // (we don't get notified of the first tile coming in, so
+          // without one look again a deadline later)
+          const double secondsToWait
+            = firstTileTime > 0.
+            ? firstTileTime+policy.deadline-now
+            : policy.deadline;
+          finishedFramesAvailable.wait_for(lock,std::chrono::duration<double>(secondsToWait));
+        }
+        
+        if (!overdueFrame) {
+          auto ret = finishedFrames.front();
+          finishedFrames.pop_front();
+          return ret;
+        }
+      }
+      finishIncompleteFrame(overdueFrame);
+    }
   }
   
   
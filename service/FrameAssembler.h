@@ -18,79 +18,322 @@
 
 #include "../common/Mailbox.h"
 #include "FrameBuffer.h"
+#include "../common/CompressedTile.h"
+// tbb
+#include <tbb/enumerable_thread_specific.h>
+// std
+#include <map>
+#include <array>
+#include <condition_variable>
+#include <atomic>
 
 namespace dw2 {
 
+  /*! tracks which pixels of a frame (per eye) got written, with
+      one bit per pixel, and which blocks of pixels are complete.
+      Unlike counting pixels, this does not get thrown off by tiles
+      that got written twice, or that overlap; and it can tell which
+      regions are still missing */
+  struct CoverageMap {
+    /*! width and height of a block, in pixels. Tiles rarely line up
+        with blocks, so missing regions are only as precise as that */
+    static const int blockSize = 16;
+    /*! a block's bits come in words of this many rows */
+    static const int rowsPerWord = 4;
+    static const int wordsPerBlock = blockSize/rowsPerWord;
+    static_assert(rowsPerWord*blockSize == 64, "a block's rows have to fill 64-bit words");
+
+    CoverageMap(const vec2i &size, int numEyes);
+
+    /*! account for given region (in the frame's pixel coordinates) of
+        given eye having been written */
+    void add(const box2i &region, int eye);
+
+    /*! whether all blocks of all eyes are covered */
+    bool complete() const { return numBlocksCovered == (int)numPixelsWritten.size(); }
+
+    /*! the regions of given eye that are not covered yet, in the
+        frame's pixel coordinates: one box per run of missing blocks
+        in a row of blocks */
+    std::vector<box2i> missingRegions(int eye) const;
+
+    /*! start over, for a new frame */
+    void clear();
+    
+  private:
+    /*! region of the block with given block coordinates */
+    inline box2i blockRegion(int bx, int by) const
+    { return box2i(vec2i(bx,by)*blockSize,min(vec2i(bx+1,by+1)*blockSize,size)); }
+    
+    const vec2i                        size;
+    const vec2i                        numBlocks;
+    /*! per block (and eye): one bit for every pixel written so far,
+        in wordsPerBlock words of rowsPerWord rows of blockSize bits */
+    std::vector<std::atomic<uint64_t>> pixelsWritten;
+    /*! per block (and eye): number of distinct pixels written so far;
+        a block is covered once that reaches its area */
+    std::vector<std::atomic<uint32_t>> numPixelsWritten;
+    std::atomic<int>                   numBlocksCovered { 0 };
+  };
+  
   struct FrameToBe : public FrameBuffer {
     typedef std::shared_ptr<FrameToBe> SP;
 
     typedef enum { FRAME_NOW_COMPLETED, FRAME_NOT_YET_DONE } MarkCompletionResult;
 
-    FrameToBe(size_t frameID, const vec2i &size, bool stereo)
+    FrameToBe(size_t frameID, const vec2i &size, bool stereo, bool withCoverageMap)
       : FrameBuffer(size,stereo),
         frameID(frameID),
-        numPixelsExpected(size.x*size.y)
+        numPixelsExpected(size.x*size.y),
+        coverage(withCoverageMap ? new CoverageMap(size,stereo?2:1) : nullptr)
     {}
 
+    /*! account for 'numNewPixels' more pixels having been written;
+        returns FRAME_NOW_COMPLETED for exactly one caller, the first
+        that finds all pixels there (see 'coverage'). Without a
+        coverage map, that's when the count matches exactly; one
+        that overshoots gets reported, not taken as complete */
     MarkCompletionResult markPixelsCompleted(size_t numNewPixels);
+
+    /*! start writing tiles into this frame; returns false if it got
+        closed already, in which case whatever we wanted to write
+        came too late */
+    bool beginWriting();
+
+    /*! done writing what beginWriting() let us write */
+    void endWriting();
+
+    /*! let nobody start writing into this frame any more, and wait
+        for whoever still does to be done; once this returns, its
+        pixels and coverage no longer change */
+    void close();
     
-    const size_t frameID;
+    /*! the frame this buffer gets assembled for; only ever changes
+        while the buffer sits in a FramePool */
+    size_t frameID;
   private:
     friend class FrameAssembler;
-    
-    std::mutex   mutex;
+    friend class FramePool;
     
     /*! total number of pixels already written this frame */
-    size_t       numPixelsCompleted = 0;
+    std::atomic<size_t> numPixelsCompleted { 0 };
     
     /*! total number of pixels we have to write this frame until we
       have a full frame buffer */
     const size_t numPixelsExpected = 0;
+
+    /*! if non-null, it's this (rather than the number of pixels
+        written) that tells when the frame is complete */
+    const std::unique_ptr<CoverageMap> coverage;
+
+    /*! set (once) by whoever finishes the frame: be it the one
+        writing its last pixels, or the one handing it on incomplete
+        because it missed its deadline */
+    std::atomic<bool>   finished { false };
+    
+    /*! when the first tile of this frame came in; 0 if none did yet.
+        Only tracked if there is a deadline */
+    std::atomic<double> firstTileTime { 0. };
+
+    /*! protects numWriters and closed */
+    std::mutex              writersMutex;
+    std::condition_variable writersDone;
+    /*! threads between beginWriting() and endWriting() */
+    int                     numWriters = 0;
+    /*! set by close(); nobody may start writing after that */
+    bool                    closed     = false;
+
+    /*! a tile (in a message, or in a container) that has to wait
+        until the frame before this one is complete */
+    struct WaitingTile {
+      Mailbox::Message::SP message;
+      size_t               offset;
+      size_t               size;
+    };
+    
+    /*! whether all pixels got written; only ever touched with the
+        assembler's mutex locked, same as waitingTiles */
+    bool                     completed = false;
+    /*! tiles that need what the frame before got (see
+        needsFrameBefore()), but arrived before it was complete */
+    std::vector<WaitingTile> waitingTiles;
   };
 
 
-  /*! class that is responsible for assembling ONE frame at a time. */
+  /*! a fixed set of frame buffers that cycle from being assembled to
+      being displayed, and back into the pool once nobody (neither
+      the assembler nor the window) holds on to them any more - so
+      once we're running we never allocate (nor clear) display-sized
+      buffers again */
+  struct FramePool : public std::enable_shared_from_this<FramePool> {
+    typedef std::shared_ptr<FramePool> SP;
+
+    FramePool(int numFrames, const vec2i &size, bool stereo, bool withCoverageMaps);
+
+    /*! get a free frame buffer to assemble given frame in, waiting
+        for one to come back if all of them are in use. Its pixels
+        are whatever the frame it last held left there */
+    FrameToBe::SP get(size_t frameID);
+
+  private:
+    /*! the deleter of the frames we hand out */
+    void release(FrameToBe *frame);
+    
+    std::vector<std::unique_ptr<FrameToBe>> frames;
+    std::vector<FrameToBe *>                freeFrames;
+    std::mutex                              mutex;
+    std::condition_variable                 frameReleased;
+  };
+
+  /*! how to tell that a frame is ready to be handed on */
+  struct FrameCompletionPolicy {
+    /*! whether to track which pixels of a frame got written (see
+        CoverageMap), rather than only how many. Costs a little per
+        tile, but a tile that shows up twice (or tiles that overlap)
+        then can no longer keep a frame from completing, nor have it
+        complete while some of its pixels are still missing */
+    bool   useCoverageMap { false };
+    /*! if > 0: hand on a frame that still is not complete this
+        many seconds after its first tile came in anyway, with
+        whatever it is missing kept from the frame before. Tiles of
+        it that come in later get dropped, and the regions it missed
+        stay out of sync with the client (see
+        FrameAssembler::outOfSync) until they get new pixels. Needs
+        the coverage map, so this turns that on */
+    double deadline       { 0. };
+  };
+
+  /*! class that is responsible for assembling frames: as many at
+      once as the inbox lets through (see
+      TimeStampedMailbox::numFramesInFlight), each in its own frame
+      buffer, and handed on strictly in order */
   struct FrameAssembler {
     typedef std::shared_ptr<FrameAssembler> SP;
-    
+
     /*! construct a new assembler, and start the assembly process */
     FrameAssembler(/*! the inbox that will contain 'setTile' messages
                        (and nothing else) */
                    TimeStampedMailbox::SP inbox,
                    const box2i &myRegion,
                    bool         stereo=false,
-                   int numThreads = 4);
+                   int numThreads = 4,
+                   const FrameCompletionPolicy &policy = FrameCompletionPolicy());
 
     /*! get next fully-assembled frame; will wait until one is
-        available. */
+        available (or, with a deadline, until the next one is
+        overdue). */
     FrameBuffer::SP collectAssembledFrame();
     
   private:
     /*! function that runs the actual assembler threads */
     void assemblerThreadFunction();
     
-    /*! create a new frame buffer to be, and return the old one. may
-        only get called by a thread that has acquired the mutex */
-    void startOnNewFrame(int newFrameID);
+    /*! add frames to assemble until we have as many as the inbox
+        lets through at once, and have the inbox let through the
+        tiles for them. Must not get called with the mutex locked */
+    void startOnNewFrames();
 
     /*! gets called by the assembler thread that wrote the last pixels
-        that completed a frame */
+        that completed a frame (or by whoever finished it incomplete);
+        closes the frame before handing it on. Callers must not be
+        writing into it themselves any more */
     void finishFrame(FrameToBe::SP finishedFrame);
+
+    /*! hand on the given frame even though it is not complete, with
+        the regions it is missing copied from the frame before */
+    void finishIncompleteFrame(FrameToBe::SP frame);
+
+    /*! if the frame before the given one is not complete yet, park
+        the given tile in 'frame' until it is (see finishFrame()), and
+        return true; else return false */
+    bool waitForFrameBefore(FrameToBe::SP frame,
+                            Mailbox::Message::SP message,
+                            size_t offset, size_t size);
+
+    /*! decode the tile message that is 'size' bytes at 'offset' in
+        given message (which may be a container), and write it into
+        given frame; returns num pixels written */
+    size_t assembleTile(FrameToBe::SP frame,
+                        TileDecoder &decoder,
+                        Mailbox::Message::SP message,
+                        size_t offset, size_t size);
+
+    /*! the part of assembleTile() that actually decodes the tile,
+        and writes its pixels into the frame */
+    size_t decodeAndWriteTile(FrameToBe::SP frame,
+                              TileDecoder &decoder,
+                              Mailbox::Message::SP message,
+                              size_t offset, size_t size);
     
-    std::mutex mutex;
+    /*! write the given (decoded) tile into the given frame,
+        upscaling it if it was rendered at less than native
+        resolution; returns num pixels written */
+    size_t writeTile(FrameToBe::SP frame, const PlainTile &tile);
+    
+    /*! decode the refinement tile that is 'size' bytes at 'offset'
+        in given message, and - if the display still shows the lossy
+        tile it refines - write it into both the frame we last
+        completed (which is what gets displayed) and the one we are
+        assembling */
+    void applyRefinement(TileDecoder &decoder,
+                         Mailbox::Message::SP message,
+                         size_t offset, size_t size);
 
-    FrameToBe::SP getCurrentFrame() {
-      std::lock_guard<std::mutex> lock(mutex);
-      return _currentFrame;
-    }
+    /*! write the given refinement if the (complete) frame on display
+        still has the lossy tile it refines; returns false if it has
+        to wait for that frame to complete. Caller has to hold the
+        refinementMutex */
+    bool tryRefine(const PlainTile &refinement);
+    
+    /*! whether any of given region (in global coordinates) of given
+        eye is out of sync (see outOfSync) */
+    bool isOutOfSync(const box2i &region, int eye);
 
-    void setCurrentFrame(FrameToBe::SP newFrame) {
+    /*! account for given region (in global coordinates) of given
+        eye no longer showing what the client thinks it does */
+    void markOutOfSync(const box2i &region, int eye);
+
+    /*! account for given region (in global coordinates) of given
+        eye having gotten pixels that do not depend on what it
+        showed before */
+    void markInSync(const box2i &region, int eye);
+    
+    /*! copy given region (in global coordinates) of the given eye
+        from the frame before 'currentFrame' into 'currentFrame', for
+        tiles the client has marked as unchanged; returns num pixels
+        written */
+    size_t copyFromPreviousFrame(FrameToBe::SP currentFrame,
+                                 const box2i &globalRegion,
+                                 int eye);
+    
+    std::mutex mutex;
+
+    /*! the frame of given ID if we are assembling it, or have
+        completed it but not handed it on yet; else null */
+    FrameToBe::SP getFrame(int frameID) {
       std::lock_guard<std::mutex> lock(mutex);
-      _currentFrame = newFrame;
+      auto it = frames.find(frameID);
+      return it == frames.end() ? nullptr : it->second;
     }
     
-    /*! the frame we are currently assembling */
-    FrameToBe::SP               _currentFrame;
+    /*! where our frame buffers come from, and go back to */
+    FramePool::SP               framePool;
+    
+    /*! the frames we are assembling, by frame ID: the oldest one not
+        handed on yet, and the ones after it the inbox lets through
+        already. Frames that complete before the ones before them
+        stay in here until those are complete, too */
+    std::map<int,FrameToBe::SP> frames;
+    
+    /*! ID of the next frame startOnNewFrames() adds */
+    int                         nextFrameID = 0;
+    
+    /*! makes sure frames get added (and the inbox moved on) in order */
+    std::mutex                  startFramesMutex;
+
+    /*! the last frame we handed on; tiles that are unchanged since
+        then get their pixels from here */
+    FrameToBe::SP               _previousFrame;
     
     /*! list of frames that have been assembled, but not yet collected
         yet. "usually" somebody should already be waiting for a frame,
@@ -109,6 +352,37 @@ namespace dw2 {
         and how many pixels we are expecting */
     const box2i                 myRegion;
     const bool                  stereo;
+    const FrameCompletionPolicy policy;
+
+    /*! for every region (and eye and scale): the last frame that
+        had actually new pixels for it, ie, the frame that a
+        refinement for that region has to refer to */
+    std::map<std::array<int,6>,int> lastChanged;
+    /*! refinements that arrived before the frame with the lossy
+        tile they refine was complete */
+    std::vector<PlainTile>      pendingRefinements;
+    /*! protects lastChanged and pendingRefinements, and makes
+        checking the one and writing a refinement atomic */
+    std::mutex                  refinementMutex;
+    
+    /*! per eye: the regions (in global coordinates) that a frame
+        handed on incomplete missed the pixels for, and that have not
+        gotten pixels of their own since. The client does not know,
+        so tiles it sends relative to what they show - unchanged
+        tiles and refinements - get rejected for these: an unchanged
+        tile keeps the pixels of the frame before, same as missing
+        one would, and a refinement gets dropped */
+    std::array<std::vector<box2i>,2> outOfSync;
+    /*! number of regions in outOfSync, to check without the lock */
+    std::atomic<size_t>         numOutOfSync { 0 };
+    std::mutex                  outOfSyncMutex;
+    
+    /*! the reference tiles our temporal decoders share */
+    ReferenceTiles::SP          references;
+    
+    /*! decoders for the (tbb) threads that assemble the tiles in a
+        container in parallel */
+    tbb::enumerable_thread_specific<TileDecoder::SP> decoders;
   };
   
 } // ::dw2
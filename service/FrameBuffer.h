@@ -25,9 +25,11 @@
 
 namespace dw2 {
   
-  /*! a (stereo-capable) frame buffer */
+  /*! a (stereo-capable) frame buffer. Pixels start out
+      uninitialized: every frame overwrites all of them anyway */
   struct FrameBuffer {
     typedef std::shared_ptr<FrameBuffer> SP;
+    typedef std::vector<uint32_t,NoInitAllocator<uint32_t>> Pixels;
     
     FrameBuffer(const vec2i &size, bool stereo=false)
       : size(size),
@@ -36,8 +38,8 @@ namespace dw2 {
     {}
     
     const vec2i size;
-    std::vector<uint32_t> leftEyePixels;
-    std::vector<uint32_t> rightEyePixels;
+    Pixels      leftEyePixels;
+    Pixels      rightEyePixels;
   };
 
 } // ::dw2
@@ -69,7 +69,7 @@ namespace dw2 {
       assert(inbox);
       if (config.useHeadNode)
         // only do that on head node; if it's a regular diplay it
-        // already does that in FrameAssembler::startOnNewFrame()
+        // already does that in FrameAssembler::startOnNewFrames()
         inbox->startNewFrame(frameID+1);
       
       //std::cout << "############## server done restart of mailbox " << frameID << "\n";
@@ -89,6 +89,7 @@ namespace dw2 {
       serviceInfo ->hasControlWindow = config.hasControlWindow;
       serviceInfo ->controlWindowSize = config.controlWindowSize;
     }
+    serviceInfo->codecs = supportedCodecs();
     
     if (config.useHeadNode) {
       // ==================================================================
@@ -166,7 +167,10 @@ namespace dw2 {
     // create an inbox that peers or clients' messages can be placed
     // into
     // ------------------------------------------------------------------
-    inbox = std::make_shared<TimeStampedMailbox>();
+    // (refinements do not belong to any frame, so they get let
+    // through right away; and with several frames in flight, the
+    // assembler works on all of them at once)
+    inbox = std::make_shared<TimeStampedMailbox>(isRefinement,config.maxFramesInFlight);
     // TimeStampedMailbox::SP inbox = std::make_shared<TimeStampedMailbox>();
     // this->timeStampedMailbox = inbox;
     
@@ -226,7 +230,10 @@ namespace dw2 {
     bool willAssembleFrames = !config.useHeadNode || world.rank() != 0;
     if (willAssembleFrames) {
       std::cout << "#dw2.server(" << world.rank() << "): creating frame assembler on rank " << world.rank() << "\n";
-      frameAssembler = std::make_shared<FrameAssembler>(inbox,myRegion);
+      FrameCompletionPolicy policy;
+      policy.useCoverageMap = config.useCoverageMap;
+      policy.deadline       = config.frameDeadline;
+      frameAssembler = std::make_shared<FrameAssembler>(inbox,myRegion,false,4,policy);
       std::cout << "#dw2.server(" << world.rank() << "): created frame assembler on rank #"
                 << world.rank() << " region " << myRegion << "\n";
     }
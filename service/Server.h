@@ -67,6 +67,9 @@ namespace dw2 {
       vec2i controlWindowSize     { 512, 512 };
       int   desiredInfoPortNum    { 2903 };
       int   maxFramesInFlight     { 1 };
+      /*! see FrameCompletionPolicy */
+      bool  useCoverageMap        { false };
+      double frameDeadline        { 0. };
 	  int   headNodePort          { 0 };
     };
 
@@ -82,6 +85,11 @@ namespace dw2 {
         ranks have reiceived their frame!) */
     FrameBuffer::SP waitForNextAssembledFrame();
 
+    /*! how many tiles our inbox had to hold back for later frames,
+        and for how long */
+    TimeStampedMailbox::DeferralStats getDeferralStats()
+    { return inbox->getDeferralStats(); }
+
   private:
     /*! gets called one per frame by *every* rank of the server (ie,
       _inluding_ the head node if one exists). As such, should never
@@ -36,6 +36,8 @@ namespace dw2 {
     std::cout << "--[no-]head-node | -[n]hn         - use / do not use dedicated head node" << "\n";
     std::cout << "--head-node-port | -hnp           - use a specific port for the head node client connections" << "\n";
     std::cout << "--max-frames-in-flight|-fif <n>   - allow up to n frames in flight" << "\n";
+    std::cout << "--coverage-map|-cm                - track which blocks of a frame got written, not just how many pixels" << "\n";
+    std::cout << "--frame-deadline|-fd <ms>         - show a frame that is not complete <ms> milliseconds after its first tile anyway" << "\n";
     std::cout << "--bezel-width|-bw <Nx> <Ny>       - assume a bezel width (between displays) of Nx and Ny pixels" << "\n";
     std::cout << "--displays-per-node|-dpn <N> <display1> ...<displayN>] " << "\n";
     std::cout << "     (specifies that each physical host in the mpi launch will have" << "\n";
@@ -118,6 +120,10 @@ namespace dw2 {
         config.doFullScreen = true;
       } else if (arg == "--max-frames-in-flight" || arg == "-fif" || arg == "-mfif") {
         config.maxFramesInFlight = atoi(av[++i]);
+      } else if (arg == "--coverage-map" || arg == "-cm") {
+        config.useCoverageMap = true;
+      } else if (arg == "--frame-deadline" || arg == "-fd") {
+        config.frameDeadline = atof(av[++i]) * 1e-3;
       } else if (arg == "--bezel-width" || arg == "--bezel" || arg == "-bw" || arg == "-b") {
         if (i+2 >= ac) {
           printf("format for --bezel|-b argument is '-b <x> <y>'\n");
@@ -236,6 +242,16 @@ namespace dw2 {
               t_avg = (t + frame_id * t_avg) / (frame_id + 1);
               ++frame_id;
               std::cout << "#server: avg frame rate: " << (1.0/t_avg) << "fps" << "\n";
+              if (frame_id % 100 == 0) {
+                const TimeStampedMailbox::DeferralStats stats = server.getDeferralStats();
+                std::cout << "#server: deferred " << prettyNumber(stats.numDeferred)
+                          << " tiles (" << stats.numDeferredNow << " now, at most "
+                          << stats.maxDeferredAtOnce << " at once), avg "
+                          << prettyDouble(stats.numReleased
+                                          ? stats.secondsDeferred/stats.numReleased
+                                          : 0.)
+                          << "s, max " << prettyDouble(stats.maxSecondsDeferred) << "s\n";
+              }
             }
           }
           t_last = t_out;
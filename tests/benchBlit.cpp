@@ -0,0 +1,155 @@
+// ======================================================================== //
+// Copyright 2019 Ingo Wald                                                 //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! micro-benchmark for blit(): copies tiles of various widths into a
+    display-sized frame buffer - with source and destination rows
+    aligned, misaligned, and with tiles that stick out of the frame
+    buffer and need clipping - and compares against a pixel-by-pixel
+    copy with per-pixel bounds checks, and against a memcpy per row */
+
+#include "../common/Blit.h"
+
+#include <chrono>
+#include <vector>
+
+namespace dw2 {
+
+  typedef std::chrono::steady_clock Clock;
+
+  inline double secondsSince(const Clock::time_point &t0)
+  {
+    return std::chrono::duration<double>(Clock::now()-t0).count();
+  }
+
+  /*! the way tiles used to get written: every pixel on its own,
+      checked against the frame buffer's bounds */
+  size_t perPixelCopy(uint32_t *dst, const box2i &dstRegion, int dstPitch,
+                      const uint32_t *src, const box2i &srcRegion, int srcPitch)
+  {
+    size_t numCopied = 0;
+    for (int iy=srcRegion.lower.y;iy<srcRegion.upper.y;iy++)
+      for (int ix=srcRegion.lower.x;ix<srcRegion.upper.x;ix++) {
+        if (ix < dstRegion.lower.x || ix >= dstRegion.upper.x ||
+            iy < dstRegion.lower.y || iy >= dstRegion.upper.y)
+          continue;
+        const size_t srcOfs = (ix-srcRegion.lower.x) + srcPitch*size_t(iy-srcRegion.lower.y);
+        const size_t dstOfs = (ix-dstRegion.lower.x) + dstPitch*size_t(iy-dstRegion.lower.y);
+        dst[dstOfs] = src[srcOfs];
+        numCopied++;
+      }
+    return numCopied;
+  }
+
+  /*! clip once, then one memcpy per row */
+  size_t rowCopy(uint32_t *dst, const box2i &dstRegion, int dstPitch,
+                 const uint32_t *src, const box2i &srcRegion, int srcPitch)
+  {
+    const box2i region = intersectionOf(dstRegion,srcRegion);
+    for (int iy=region.lower.y;iy<region.upper.y;iy++)
+      memcpy(dst + (region.lower.x-dstRegion.lower.x) + dstPitch*size_t(iy-dstRegion.lower.y),
+             src + (region.lower.x-srcRegion.lower.x) + srcPitch*size_t(iy-srcRegion.lower.y),
+             region.size().x*sizeof(uint32_t));
+    return region.size().product();
+  }
+
+  /*! blit() as the frame assembler calls it, ie, streaming wide
+      rows */
+  size_t streamingBlit(uint32_t *dst, const box2i &dstRegion, int dstPitch,
+                       const uint32_t *src, const box2i &srcRegion, int srcPitch)
+  {
+    return blit(dst,dstRegion,dstPitch,src,srcRegion,srcPitch);
+  }
+
+  typedef size_t (*CopyFct)(uint32_t *, const box2i &, int,
+                            const uint32_t *, const box2i &, int);
+  
+  /*! copy the frame buffer full of 'tileWidth'-wide tiles (all
+      shifted by 'shift' pixels); returns copied gigabytes per
+      second */
+  double measure(CopyFct copy, uint32_t *frame, const vec2i &frameSize,
+                 const uint32_t *tile, int tileWidth, const vec2i &shift,
+                 double minSeconds)
+  {
+    const box2i frameRegion(vec2i(0,0),frameSize);
+    const int   tileHeight = std::max(1,(256*256)/tileWidth);
+    size_t numCopied = 0;
+    const Clock::time_point t0 = Clock::now();
+    do {
+      for (int y=0;y<frameSize.y;y+=tileHeight)
+        for (int x=0;x<frameSize.x;x+=tileWidth) {
+          const box2i tileRegion(vec2i(x,y)+shift,vec2i(x+tileWidth,y+tileHeight)+shift);
+          numCopied += copy(frame,frameRegion,frameSize.x,tile,tileRegion,tileWidth);
+        }
+    } while (secondsSince(t0) < minSeconds);
+    return numCopied*sizeof(uint32_t) / secondsSince(t0) * 1e-9;
+  }
+  
+  extern "C" int main(int ac, char **av)
+  {
+    vec2i  frameSize(3840,2160);
+    double minSeconds = .5;
+    for (int i=1;i<ac;i++) {
+      const std::string arg = av[i];
+      if (arg == "--size") {
+        frameSize.x = std::atoi(av[++i]);
+        frameSize.y = std::atoi(av[++i]);
+      } else if (arg == "--seconds")
+        minSeconds = std::atof(av[++i]);
+      else {
+        std::cout << "usage: ./dw2_benchBlit [--size width height] [--seconds minSecondsPerCase]" << "\n";
+        exit(1);
+      }
+    }
+
+    // one extra pixel in front, so we can misalign the source, too
+    std::vector<uint32_t> frame(frameSize.x*size_t(frameSize.y)+1);
+    std::vector<uint32_t> tile(256*256+frameSize.x+1);
+    for (size_t i=0;i<tile.size();i++)
+      tile[i] = uint32_t(i*0x9E3779B1u);
+
+    struct Case {
+      const char *name;
+      /*! source and destination are one pixel off their 16-byte
+          alignment */
+      bool        misaligned;
+      /*! tiles are shifted such that every one at the frame buffer's
+          right and bottom borders needs clipping */
+      vec2i       shift;
+    };
+    const Case cases[] = {
+      { "aligned   ", false, vec2i(0,0) },
+      { "misaligned", true,  vec2i(0,0) },
+      { "clipped   ", false, vec2i(7,5) }
+    };
+    
+    std::cout << "#dw2.bench: copying tiles into a " << frameSize.x << "x" << frameSize.y
+              << " frame buffer (GB/s)" << "\n";
+    for (int tileWidth : { 64, 256, 1024, frameSize.x })
+      for (const Case &c : cases) {
+        uint32_t       *dst = frame.data()+c.misaligned;
+        const uint32_t *src = tile.data()+c.misaligned;
+        const double perPixel = measure(perPixelCopy,dst,frameSize,src,tileWidth,c.shift,minSeconds);
+        const double perRow   = measure(rowCopy,dst,frameSize,src,tileWidth,c.shift,minSeconds);
+        const double blitted  = measure(streamingBlit,dst,frameSize,src,tileWidth,c.shift,minSeconds);
+        std::cout << "  " << c.name << " tiles " << tileWidth << " wide: per-pixel "
+                  << perPixel << ", memcpy per row " << perRow
+                  << ", blit " << blitted
+                  << " (" << (blitted/perPixel) << "x)" << "\n";
+      }
+    return 0;
+  }
+
+} // ::dw2
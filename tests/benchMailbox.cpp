@@ -0,0 +1,169 @@
+// ======================================================================== //
+// Copyright 2019 Ingo Wald                                                 //
+//                                                                          //
+// Licensed under the Apache License, Version 2.0 (the "License");          //
+// you may not use this file except in compliance with the License.         //
+// You may obtain a copy of the License at                                  //
+//                                                                          //
+//     http://www.apache.org/licenses/LICENSE-2.0                           //
+//                                                                          //
+// Unless required by applicable law or agreed to in writing, software      //
+// distributed under the License is distributed on an "AS IS" BASIS,        //
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. //
+// See the License for the specific language governing permissions and      //
+// limitations under the License.                                           //
+// ======================================================================== //
+
+/*! micro-benchmark for the mailbox queue: measures put/get throughput
+    for various numbers of producer and consumer threads, and the
+    latency of waking up a consumer that is blocked in get(); both for
+    the current (lock-free) mailbox and for the old mutex/condition
+    variable one it replaced */
+
+#include "../common/Mailbox.h"
+
+#include <atomic>
+#include <chrono>
+#include <unistd.h>
+
+namespace dw2 {
+
+  /*! the mailbox as it was before it moved to the lock-free queue -
+      one mutex, one condition variable, notify_all on every put */
+  struct LockedMailbox {
+    void put(Mailbox::Message::SP message)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      messages.push_back(message);
+      newMessageAvailable.notify_all();
+    }
+
+    Mailbox::Message::SP get()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (messages.empty())
+        newMessageAvailable.wait(lock);
+      auto ret = messages.front();
+      messages.pop_front();
+      return ret;
+    }
+
+    std::deque<Mailbox::Message::SP> messages;
+    std::mutex                       mutex;
+    std::condition_variable          newMessageAvailable;
+  };
+
+  typedef std::chrono::steady_clock Clock;
+
+  inline double secondsSince(const Clock::time_point &t0)
+  {
+    return std::chrono::duration<double>(Clock::now()-t0).count();
+  }
+
+  /*! push 'numMessages' through the box, using given number of
+      producers and consumers; returns messages per second */
+  template<typename BoxT>
+  double measureThroughput(int numProducers, int numConsumers, size_t numMessages)
+  {
+    BoxT box;
+    Mailbox::Message::SP message = std::make_shared<Mailbox::Message>();
+    const size_t perProducer = numMessages / numProducers;
+    const size_t total       = perProducer * numProducers;
+    std::atomic<size_t> numReceived(0);
+
+    std::vector<std::thread> threads;
+    const Clock::time_point t0 = Clock::now();
+    for (int i=0;i<numProducers;i++)
+      threads.push_back(std::thread([&](){
+            for (size_t j=0;j<perProducer;j++)
+              box.put(message);
+          }));
+    for (int i=0;i<numConsumers;i++)
+      threads.push_back(std::thread([&](){
+            while (1) {
+              if (!box.get()) break;
+              if (++numReceived == total)
+                // tell all other consumers to stop
+                for (int k=0;k<numConsumers;k++)
+                  box.put(nullptr);
+            }
+          }));
+    for (auto &t : threads) t.join();
+    return total / secondsSince(t0);
+  }
+
+  /*! measures how long it takes from a put() until a consumer that
+      was already parked in get() has the message; returns average,
+      median, and 99th percentile, in microseconds */
+  template<typename BoxT>
+  std::vector<double> measureWakeupLatency(int numSamples)
+  {
+    BoxT box;
+    Mailbox::Message::SP message = std::make_shared<Mailbox::Message>();
+    std::atomic<int64_t> putTime(0);
+    std::vector<double> latencies;
+
+    std::thread consumer([&](){
+        for (int i=0;i<numSamples;i++) {
+          box.get();
+          const int64_t now = Clock::now().time_since_epoch().count();
+          latencies.push_back((now - putTime.load())
+                              * 1e6 * Clock::period::num / Clock::period::den);
+        }
+      });
+    for (int i=0;i<numSamples;i++) {
+      // give the consumer time to actually go to sleep
+      usleep(1000);
+      putTime.store(Clock::now().time_since_epoch().count());
+      box.put(message);
+    }
+    consumer.join();
+
+    std::sort(latencies.begin(),latencies.end());
+    double sum = 0.;
+    for (auto l : latencies) sum += l;
+    return { sum/numSamples,
+             latencies[numSamples/2],
+             latencies[std::min(numSamples-1,(numSamples*99)/100)] };
+  }
+
+  extern "C" int main(int ac, char **av)
+  {
+    size_t numMessages = 2000000;
+    int    numSamples  = 1000;
+    for (int i=1;i<ac;i++) {
+      const std::string arg = av[i];
+      if (arg == "-n" || arg == "--num-messages")
+        numMessages = std::atol(av[++i]);
+      else if (arg == "--num-samples")
+        numSamples = std::atoi(av[++i]);
+      else {
+        std::cout << "usage: ./dw2_benchMailbox [-n numMessages] [--num-samples numSamples]" << "\n";
+        exit(1);
+      }
+    }
+
+    std::cout << "#dw2.bench: put/get throughput (messages/second)" << "\n";
+    const std::vector<std::pair<int,int>> configs
+      = { {1,1}, {1,4}, {4,1}, {4,4}, {16,4}, {4,16} };
+    for (auto config : configs) {
+      const double locked   = measureThroughput<LockedMailbox>(config.first,config.second,numMessages);
+      const double lockFree = measureThroughput<Mailbox>(config.first,config.second,numMessages);
+      std::cout << "  " << config.first << " producer(s), "
+                << config.second << " consumer(s): locked "
+                << prettyDouble(locked) << ", lock-free "
+                << prettyDouble(lockFree)
+                << " (" << (lockFree/locked) << "x)" << "\n";
+    }
+
+    std::cout << "#dw2.bench: wake-up latency of a parked consumer (microseconds)" << "\n";
+    const std::vector<double> locked   = measureWakeupLatency<LockedMailbox>(numSamples);
+    const std::vector<double> lockFree = measureWakeupLatency<Mailbox>(numSamples);
+    std::cout << "  locked    : avg " << locked[0]
+              << ", median " << locked[1] << ", p99 " << locked[2] << "\n";
+    std::cout << "  lock-free : avg " << lockFree[0]
+              << ", median " << lockFree[1] << ", p99 " << lockFree[2] << "\n";
+    return 0;
+  }
+
+} // ::dw2